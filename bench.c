@@ -0,0 +1,627 @@
+/**
+ * @file bench.c
+ * Latency benchmarks for the allocator, lists, hash table and hash tree
+ *
+ * Copyright 2017, ECLB Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "omem.h"
+
+#define BENCH_HEAP_SIZE     (256 * 1024 * 1024)
+#define BENCH_OPS           100000
+#define BENCH_RUNS          5
+#define BENCH_WARMUP        1
+#define BENCH_LIST_LENGTH   1000
+#define BENCH_BUCKETS       1024
+
+/* Each benchmark times one kind of operation, n times per run, keeping
+ * the ticks taken by each in samples */
+typedef struct bench_ctx {
+    om_block *om;
+    size_t n;
+    uint64_t *samples;
+    size_t count;
+    uint64_t seed;
+} bench_ctx;
+
+typedef struct bench {
+    const char *name;
+    void (*run)(bench_ctx * b);
+} bench;
+
+typedef struct bench_mode {
+    const char *name;
+    unsigned int flags;
+} bench_mode;
+
+static const bench_mode modes[] = {
+    {"default", 0},
+    {"locked", OM_LOCKED},
+    {"cached", OM_LOCKED | OM_CACHED},
+    {"buddy", OM_BUDDY},
+    {NULL, 0},
+};
+
+static uint64_t timer_overhead;
+static double ns_per_tick = 1.0;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TIMER_NAME "rdtscp"
+static inline uint64_t ticks(void)
+{
+    unsigned int aux;
+    return __rdtscp(&aux);
+}
+#else
+#define TIMER_NAME "clock_gettime"
+static inline uint64_t ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+#define TIMED(b, stmt) do { \
+        uint64_t _start = ticks(); \
+        stmt; \
+        (b)->samples[(b)->count++] = ticks() - _start; \
+    } while (0)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Convert ticks to ns against the clock, and find the cost of reading the timer */
+static void timer_calibrate(void)
+{
+    uint64_t t0, n0, t1, n1, min = UINT64_MAX;
+    int i;
+
+    n0 = now_ns();
+    t0 = ticks();
+    while (now_ns() - n0 < 50000000) ;
+    t1 = ticks();
+    n1 = now_ns();
+    ns_per_tick = (double) (n1 - n0) / (t1 - t0);
+    for (i = 0; i < 10000; i++) {
+        t0 = ticks();
+        t1 = ticks();
+        min = t1 - t0 < min ? t1 - t0 : min;
+    }
+    timer_overhead = min;
+}
+
+static inline uint64_t bench_rand(bench_ctx * b)
+{
+    b->seed ^= b->seed << 13;
+    b->seed ^= b->seed >> 7;
+    b->seed ^= b->seed << 17;
+    return b->seed;
+}
+
+/* Allocator */
+
+static void bench_malloc_64(bench_ctx * b)
+{
+    void **m = malloc(b->n * sizeof(void *));
+    size_t i;
+
+    for (i = 0; i < b->n; i++)
+        TIMED(b, m[i] = omalloc(b->om, 64));
+    for (i = 0; i < b->n; i++)
+        omfree(b->om, m[i]);
+    free(m);
+}
+
+static void bench_free_64(bench_ctx * b)
+{
+    void **m = malloc(b->n * sizeof(void *));
+    size_t i;
+
+    for (i = 0; i < b->n; i++)
+        m[i] = omalloc(b->om, 64);
+    for (i = 0; i < b->n; i++)
+        TIMED(b, omfree(b->om, m[i]));
+    free(m);
+}
+
+static void bench_malloc_random(bench_ctx * b)
+{
+    void **m = malloc(b->n * sizeof(void *));
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        size_t size = 16 + bench_rand(b) % 512;
+        TIMED(b, m[i] = omalloc(b->om, size));
+    }
+    for (i = 0; i < b->n; i++)
+        omfree(b->om, m[i]);
+    free(m);
+}
+
+/* Frees in a random order, so neighbours are merged */
+static void bench_free_random(bench_ctx * b)
+{
+    void **m = malloc(b->n * sizeof(void *));
+    size_t i;
+
+    for (i = 0; i < b->n; i++)
+        m[i] = omalloc(b->om, 16 + bench_rand(b) % 512);
+    for (i = b->n - 1; i > 0; i--) {
+        size_t j = bench_rand(b) % (i + 1);
+        void *t = m[i];
+        m[i] = m[j];
+        m[j] = t;
+    }
+    for (i = 0; i < b->n; i++)
+        TIMED(b, omfree(b->om, m[i]));
+    free(m);
+}
+
+/* A working set of 1024 blocks, each replaced by one of another size */
+static void bench_malloc_free_churn(bench_ctx * b)
+{
+    void *m[1024] = { };
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        size_t slot = bench_rand(b) % 1024;
+        size_t size = 16 + bench_rand(b) % 1024;
+        TIMED(b, omfree(b->om, m[slot]); m[slot] = omalloc(b->om, size));
+    }
+    for (i = 0; i < 1024; i++)
+        omfree(b->om, m[i]);
+}
+
+static void bench_realloc_grow(bench_ctx * b)
+{
+    void *m[64] = { };
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        size_t slot = i % 64;
+        size_t size = 16 + (i / 64 % 64) * 64;
+        if (size == 16) {
+            omfree(b->om, m[slot]);
+            m[slot] = NULL;
+        }
+        TIMED(b, m[slot] = omrealloc(b->om, m[slot], size));
+    }
+    for (i = 0; i < 64; i++)
+        omfree(b->om, m[i]);
+}
+
+/* Lists */
+
+static omlistentry **list_entries(bench_ctx * b, size_t n)
+{
+    omlistentry **e = malloc(n * sizeof(omlistentry *));
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        e[i] = omcalloc(b->om, 1, sizeof(omlistentry) + sizeof(size_t));
+    return e;
+}
+
+static void list_entries_free(bench_ctx * b, omlistentry ** e, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        omfree(b->om, e[i]);
+    free(e);
+}
+
+static void bench_list_prepend(bench_ctx * b)
+{
+    omlistentry **e = list_entries(b, b->n);
+    omlist l = OMLIST_INIT;
+    size_t i;
+
+    for (i = 0; i < b->n; i++)
+        TIMED(b, l = omlist_prepend(b->om, l, e[i]));
+    list_entries_free(b, e, b->n);
+}
+
+static bool list_match(om_block * om, omlistentry * e, void *data)
+{
+    return *(size_t *) (e + 1) == (size_t) data;
+}
+
+static void bench_list_find(bench_ctx * b)
+{
+    omlistentry **e = list_entries(b, BENCH_LIST_LENGTH);
+    omlist l = OMLIST_INIT;
+    size_t i;
+
+    for (i = 0; i < BENCH_LIST_LENGTH; i++) {
+        *(size_t *) (e[i] + 1) = i;
+        l = omlist_prepend(b->om, l, e[i]);
+    }
+    for (i = 0; i < b->n; i++) {
+        size_t key = bench_rand(b) % BENCH_LIST_LENGTH;
+        TIMED(b, omlist_find(b->om, l, list_match, (void *) key));
+    }
+    list_entries_free(b, e, BENCH_LIST_LENGTH);
+}
+
+static void bench_list_remove(bench_ctx * b)
+{
+    omlistentry **e = list_entries(b, b->n);
+    omlist l = OMLIST_INIT;
+    size_t i;
+
+    for (i = 0; i < b->n; i++)
+        l = omlist_prepend(b->om, l, e[i]);
+    for (i = 0; i < b->n; i++) {
+        size_t j = bench_rand(b) % (b->n - i);
+        omlistentry *t = e[j];
+        e[j] = e[b->n - i - 1];
+        e[b->n - i - 1] = t;
+        TIMED(b, l = omlist_remove(b->om, l, t));
+    }
+    list_entries_free(b, e, b->n);
+}
+
+/* Hash table */
+
+typedef struct bench_entry {
+    omhtentry base;
+    size_t key;
+} bench_entry;
+
+static size_t entry_hash(size_t key)
+{
+    return key * 0x9E3779B97F4A7C15ULL >> 16;
+}
+
+static bool entry_match(om_block * om, omhtentry * e, void *data)
+{
+    return ((bench_entry *) e)->key == (size_t) data;
+}
+
+static omhtable *table_fill(bench_ctx * b, bench_entry *** entries, bool timed)
+{
+    omhtable *ht = omcalloc(b->om, 1, OMHTABLE_SIZE(BENCH_BUCKETS));
+    bench_entry **e = malloc(b->n * sizeof(bench_entry *));
+    size_t i;
+
+    ht->size = BENCH_BUCKETS;
+    for (i = 0; i < b->n; i++) {
+        e[i] = omcalloc(b->om, 1, sizeof(bench_entry));
+        e[i]->key = i;
+        if (timed)
+            TIMED(b, omhtable_add(b->om, ht, entry_hash(i), &e[i]->base));
+        else
+            omhtable_add(b->om, ht, entry_hash(i), &e[i]->base);
+    }
+    *entries = e;
+    return ht;
+}
+
+static void table_free(bench_ctx * b, omhtable * ht, bench_entry ** e, bool deleted)
+{
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        if (!deleted)
+            omhtable_delete(b->om, ht, entry_hash(e[i]->key), &e[i]->base);
+        omfree(b->om, e[i]);
+    }
+    omfree(b->om, ht);
+    free(e);
+}
+
+static void bench_htable_add(bench_ctx * b)
+{
+    bench_entry **e;
+    omhtable *ht = table_fill(b, &e, true);
+
+    table_free(b, ht, e, false);
+}
+
+static void bench_htable_find(bench_ctx * b)
+{
+    bench_entry **e;
+    omhtable *ht = table_fill(b, &e, false);
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        size_t key = bench_rand(b) % b->n;
+        TIMED(b, omhtable_find(b->om, ht, entry_match, entry_hash(key), (void *) key));
+    }
+    table_free(b, ht, e, false);
+}
+
+static void bench_htable_delete(bench_ctx * b)
+{
+    bench_entry **e;
+    omhtable *ht = table_fill(b, &e, false);
+    size_t i;
+
+    for (i = 0; i < b->n; i++)
+        TIMED(b, omhtable_delete(b->om, ht, entry_hash(i), &e[i]->base));
+    table_free(b, ht, e, true);
+}
+
+/* Hash tree, 64 directories of leaves */
+
+static void tree_path(char *path, size_t i)
+{
+    sprintf(path, "/bench/d%zu/n%zu", i % 64, i);
+}
+
+static void bench_htree_add(bench_ctx * b)
+{
+    omhtree root = { };
+    omhtree **nodes = malloc(b->n * sizeof(omhtree *));
+    char path[64];
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        tree_path(path, i);
+        TIMED(b, nodes[i] = omhtree_add(b->om, &root, path, sizeof(omhtree)));
+    }
+    for (i = 0; i < b->n; i++)
+        omhtree_delete(b->om, &root, nodes[i]);
+    free(nodes);
+}
+
+static void bench_htree_get(bench_ctx * b)
+{
+    omhtree root = { };
+    omhtree **nodes = malloc(b->n * sizeof(omhtree *));
+    char path[64];
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        tree_path(path, i);
+        nodes[i] = omhtree_add(b->om, &root, path, sizeof(omhtree));
+    }
+    for (i = 0; i < b->n; i++) {
+        tree_path(path, bench_rand(b) % b->n);
+        TIMED(b, omhtree_get(b->om, &root, path));
+    }
+    for (i = 0; i < b->n; i++)
+        omhtree_delete(b->om, &root, nodes[i]);
+    free(nodes);
+}
+
+static void bench_htree_delete(bench_ctx * b)
+{
+    omhtree root = { };
+    omhtree **nodes = malloc(b->n * sizeof(omhtree *));
+    char path[64];
+    size_t i;
+
+    for (i = 0; i < b->n; i++) {
+        tree_path(path, i);
+        nodes[i] = omhtree_add(b->om, &root, path, sizeof(omhtree));
+    }
+    for (i = 0; i < b->n; i++)
+        TIMED(b, omhtree_delete(b->om, &root, nodes[i]));
+    free(nodes);
+}
+
+static const bench benches[] = {
+    {"malloc 64", bench_malloc_64},
+    {"free 64", bench_free_64},
+    {"malloc random", bench_malloc_random},
+    {"free random", bench_free_random},
+    {"malloc/free churn", bench_malloc_free_churn},
+    {"realloc grow", bench_realloc_grow},
+    {"list prepend", bench_list_prepend},
+    {"list find", bench_list_find},
+    {"list remove", bench_list_remove},
+    {"htable add", bench_htable_add},
+    {"htable find", bench_htable_find},
+    {"htable delete", bench_htable_delete},
+    {"htree add", bench_htree_add},
+    {"htree get", bench_htree_get},
+    {"htree delete", bench_htree_delete},
+    {NULL, NULL},
+};
+
+/* Leave the heap fragmented before each run. Holes frees every other block
+ * of a fill of half the heap, random frees a random half of blocks of
+ * random sizes filling three quarters of it. */
+static void fragment(om_block * om, const char *pattern, uint64_t seed)
+{
+    bench_ctx b = {.seed = seed };
+    size_t size = omavailable(om), used = 0, i;
+    bool holes = strcmp(pattern, "holes") == 0;
+
+    if (strcmp(pattern, "none") == 0)
+        return;
+    for (i = 0; used < (holes ? size / 2 : size / 4 * 3); i++) {
+        size_t before = omavailable(om);
+        void *m = omalloc(om, holes ? 64 + (i % 16) * 64 : 16 + bench_rand(&b) % 8192);
+
+        used += before - omavailable(om);
+        if (holes ? i % 2 : bench_rand(&b) % 2)
+            omfree(om, m);
+    }
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(uint64_t * sorted, size_t n, double p)
+{
+    size_t i = (size_t) ceil(p * n);
+    return (i ? sorted[i - 1] : sorted[0]) * ns_per_tick;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] [benchmark ...]\n"
+            "  -s <bytes>    heap size (default %d)\n"
+            "  -n <ops>      operations per run (default %d)\n"
+            "  -r <runs>     measured runs (default %d)\n"
+            "  -w <runs>     warmup runs (default %d)\n"
+            "  -f <pattern>  fragmentation before each run: none, holes or random\n"
+            "  -m <mode>     heap mode: default, locked, cached or buddy\n"
+            "  -o <file>     write the JSON results to file (default stdout)\n"
+            "Benchmarks are chosen by name prefix, all by default.\n",
+            prog, BENCH_HEAP_SIZE, BENCH_OPS, BENCH_RUNS, BENCH_WARMUP);
+}
+
+static bool selected(const char *name, int argc, char *argv[])
+{
+    int i;
+
+    if (argc == 0)
+        return true;
+    for (i = 0; i < argc; i++) {
+        if (strncmp(name, argv[i], strlen(argv[i])) == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t heap_size = BENCH_HEAP_SIZE, ops = BENCH_OPS;
+    unsigned int runs = BENCH_RUNS, warmup = BENCH_WARMUP;
+    const char *pattern = "none", *output = NULL;
+    const bench_mode *mode = &modes[0];
+    FILE *out = stdout;
+    const bench *t;
+    bool first = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:r:w:f:m:o:h")) != -1) {
+        switch (opt) {
+        case 's':
+            heap_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            ops = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            runs = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            warmup = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            pattern = optarg;
+            break;
+        case 'm':
+            for (mode = modes; mode->name && strcmp(mode->name, optarg); mode++) ;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!mode->name || !ops || !runs || (strcmp(pattern, "none") &&
+                                         strcmp(pattern, "holes") &&
+                                         strcmp(pattern, "random"))) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (output && (out = fopen(output, "w")) == NULL) {
+        perror("fopen");
+        return 1;
+    }
+
+    timer_calibrate();
+    fprintf(out, "{\n  \"heap_size\": %zu,\n  \"ops\": %zu,\n  \"runs\": %u,\n"
+            "  \"warmup\": %u,\n  \"pattern\": \"%s\",\n  \"mode\": \"%s\",\n"
+            "  \"timer\": \"%s\",\n  \"ns_per_tick\": %.4f,\n  \"benchmarks\": [",
+            heap_size, ops, runs, warmup, pattern, mode->name, TIMER_NAME, ns_per_tick);
+    for (t = benches; t->name; t++) {
+        bench_ctx b = {.n = ops,.seed = 0x9E3779B97F4A7C15ULL };
+        double *run_mean = calloc(runs, sizeof(double));
+        double sum = 0, var = 0, p50, p99, p999;
+        unsigned int r;
+        size_t i;
+
+        if (!selected(t->name, argc - optind, argv + optind))
+            continue;
+        b.samples = malloc(ops * runs * sizeof(uint64_t));
+        for (r = 0; r < warmup + runs; r++) {
+            om_options opts = {.flags = mode->flags };
+            size_t start = b.count;
+
+            b.om = omcreate_opts(NULL, heap_size, 0, &opts);
+            if (!b.om) {
+                fprintf(stderr, "Failed to create a %zu byte heap\n", heap_size);
+                return 1;
+            }
+            fragment(b.om, pattern, r + 1);
+            t->run(&b);
+            omdestroy(b.om);
+            if (r < warmup) {
+                b.count = start;
+                continue;
+            }
+            for (i = start; i < b.count; i++) {
+                b.samples[i] = b.samples[i] > timer_overhead ?
+                    b.samples[i] - timer_overhead : 0;
+                run_mean[r - warmup] += b.samples[i];
+            }
+            run_mean[r - warmup] = run_mean[r - warmup] * ns_per_tick / (b.count - start);
+        }
+        for (i = 0; i < b.count; i++)
+            sum += b.samples[i];
+        for (r = 0; r < runs; r++)
+            var += (run_mean[r] - sum * ns_per_tick / b.count) *
+                (run_mean[r] - sum * ns_per_tick / b.count);
+        qsort(b.samples, b.count, sizeof(uint64_t), u64_cmp);
+
+        p50 = percentile(b.samples, b.count, 0.5);
+        p99 = percentile(b.samples, b.count, 0.99);
+        p999 = percentile(b.samples, b.count, 0.999);
+
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"samples\": %zu, \"mean_ns\": %.1f, "
+                "\"run_stddev_ns\": %.1f, \"min_ns\": %.1f, \"p50_ns\": %.1f, "
+                "\"p99_ns\": %.1f, \"p99.9_ns\": %.1f, \"max_ns\": %.1f}",
+                first ? "" : ",", t->name, b.count, sum * ns_per_tick / b.count,
+                sqrt(var / runs), b.samples[0] * ns_per_tick, p50, p99, p999,
+                b.samples[b.count - 1] * ns_per_tick);
+        fprintf(stderr, "%-20s p50 %8.1f ns  p99 %8.1f ns  p99.9 %8.1f ns\n", t->name,
+                p50, p99, p999);
+        first = false;
+        free(b.samples);
+        free(run_mean);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
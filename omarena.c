@@ -0,0 +1,131 @@
+/**
+ * @file omarena.c
+ * Offset based region allocator for transient data
+ *
+ * Copyright 2017, ECLB Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+#include "omem.h"
+
+#define ARENA_ALIGN(size)       (((size) + 7) & ~((size_t) 7))
+
+/* Each chunk starts with a link to the previous chunk of the arena */
+typedef struct omarena_chunk {
+    offset_t next;
+    size_t size;
+    uint8_t data[0];
+} omarena_chunk;
+
+static omarena_chunk *chunk_new(om_block * om, size_t size)
+{
+    omarena_chunk *chunk = omalloc(om, sizeof(omarena_chunk) + size);
+    if (chunk) {
+        chunk->next = 0;
+        chunk->size = size;
+    }
+    return chunk;
+}
+
+omarena *omarena_create(om_block * om, size_t chunk)
+{
+    omarena *arena;
+
+    chunk = ARENA_ALIGN(chunk ? chunk : OMARENA_CHUNK_SIZE);
+    arena = omalloc(om, sizeof(omarena));
+    if (!arena)
+        return NULL;
+    arena->chunk = chunk;
+    arena->chunks = 0;
+    arena->next = 0;
+    arena->end = 0;
+    return arena;
+}
+
+void *omarena_alloc(om_block * om, omarena * arena, size_t size)
+{
+    omarena_chunk *chunk;
+    void *m;
+
+    if (!size)
+        return NULL;
+    size = ARENA_ALIGN(size);
+
+    if (size > arena->end - arena->next) {
+        if (size > arena->chunk / 4) {
+            /* Large objects get a chunk of their own behind the current one */
+            if ((chunk = chunk_new(om, size)) == NULL)
+                return NULL;
+            if (arena->chunks) {
+                omarena_chunk *head = omo2p(om, arena->chunks);
+                chunk->next = head->next;
+                head->next = omp2o(om, chunk);
+            } else {
+                chunk->next = 0;
+                arena->chunks = omp2o(om, chunk);
+            }
+            return chunk->data;
+        }
+        if ((chunk = chunk_new(om, arena->chunk)) == NULL)
+            return NULL;
+        chunk->next = arena->chunks;
+        arena->chunks = omp2o(om, chunk);
+        arena->next = omp2o(om, chunk->data);
+        arena->end = arena->next + chunk->size;
+    }
+    m = omo2p(om, arena->next);
+    arena->next += size;
+    return m;
+}
+
+void omarena_reset(om_block * om, omarena * arena)
+{
+    omarena_chunk *chunk = omo2p(om, arena->chunks);
+    omarena_chunk *keep = NULL;
+
+    /* Keep one standard chunk to bump allocate from again */
+    while (chunk) {
+        omarena_chunk *next = omo2p(om, chunk->next);
+        if (!keep && chunk->size == arena->chunk) {
+            keep = chunk;
+            keep->next = 0;
+        } else {
+            omfree(om, chunk);
+        }
+        chunk = next;
+    }
+    arena->chunks = omp2o(om, keep);
+    arena->next = keep ? omp2o(om, keep->data) : 0;
+    arena->end = keep ? arena->next + keep->size : 0;
+}
+
+void omarena_destroy(om_block * om, omarena * arena)
+{
+    omarena_chunk *chunk;
+
+    if (!arena)
+        return;
+    while ((chunk = omo2p(om, arena->chunks)) != NULL) {
+        arena->chunks = chunk->next;
+        omfree(om, chunk);
+    }
+    omfree(om, arena);
+}
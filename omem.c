@@ -22,8 +22,18 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <glib.h>
@@ -34,83 +44,227 @@
 #define VALGRIND_MALLOCLIKE_BLOCK(addr, sizeB, rzB, is_zeroed)
 #define VALGRIND_FREELIKE_BLOCK(addr, rzB)
 #define VALGRIND_MAKE_MEM_DEFINED(_qzz_addr,_qzz_len)
+#define VALGRIND_RESIZEINPLACE_BLOCK(addr, oldSizeB, newSizeB, rzB) ((void) (oldSizeB))
 #endif
 #include "omem.h"
 
-/* Meta stored at start and end of allocated blocks */
+/* Meta stored at the start of every block and the end of free blocks */
 typedef struct om_meta {
     size_t mark;
 } om_meta;
 
+/* Free blocks are linked into their bin through the payload */
+typedef struct om_free {
+    om_meta meta;
+    offset_t next;
+    offset_t prev;
+} om_free;
+
+/* Minimum sized free blocks only have room for 32-bit links. These count
+ * ALIGNMENT units from the start of the block's region of the heap, plus
+ * one so zero ends a list, and each region has a list of its own. */
+typedef struct om_tiny {
+    om_meta meta;
+    uint32_t next;
+    uint32_t prev;
+} om_tiny;
+
+/* Large free blocks are nodes of a treap ordered by size then address.
+ * They are never near the minimum size, so the children are offsets. */
+typedef struct om_tree {
+    om_meta meta;
+    offset_t left;
+    offset_t right;
+} om_tree;
+
+/* Relocatable blocks are reached through a table of offsets. Free
+ * entries are chained by odd values so they never match a block. */
+typedef struct om_handles {
+    size_t count;
+    size_t used;
+    omhandle free;
+    offset_t entry[0];
+} om_handles;
+
+#define HANDLE_FREE(next)       (((next) << 1) | 1)
+
 /* Macro's for manipulating block meta-data */
 #define META_SIZE               sizeof(om_meta)
 #define ALIGNMENT               8       /* Must be a power of 2 */
 #define BLK_BASE(om)            ((size_t)om + sizeof(om_block) + om->headroom)
-#define BLK_MIN_SIZE            ((2 * META_SIZE) + 8)
+#define BLK_MIN_SIZE            (sizeof(om_tiny) + META_SIZE)
+#define BLK_LINKS               sizeof(om_tree)         /* Head of a free block's payload */
 #define BLK_ALIGN(size)         (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
-#define BLK_USED(m)             ((m)->mark & 1)
+#define BLK_REQUEST(size)       (BLK_ALIGN((size) + META_SIZE) > BLK_MIN_SIZE ? \
+                                 BLK_ALIGN((size) + META_SIZE) : BLK_MIN_SIZE)
+#define BLK_PAYLOAD(size)       ((size) - META_SIZE)
+#define BLK_F_USED              1
+#define BLK_F_ZERO              2       /* Free block payload beyond the links is zero */
+#define BLK_F_PREV_FREE         4       /* Previous block is free, so has a footer */
+#define BLK_F_SAMPLED           2       /* Used block is in the profiler table */
+#define BLK_USED(m)             ((m)->mark & BLK_F_USED)
 #define BLK_FREE(m)             (!BLK_USED((m)))
-#define BLK_SIZE(m)             ((m)->mark & ~1L)
+#define BLK_ZERO(m)             ((m)->mark & BLK_F_ZERO)
+#define BLK_PREV_FREE(m)        ((m)->mark & BLK_F_PREV_FREE)
+#define BLK_SAMPLED(m)          ((m)->mark & BLK_F_SAMPLED)
+#define BLK_SIZE(m)             ((m)->mark & ~(size_t)(ALIGNMENT - 1))
 #define BLK_HEAD(m)             (m)
 #define BLK_FOOT(m)             ((om_meta *)((uint8_t *)(m) + BLK_SIZE((m)) - META_SIZE))
-#define BLK_SET(m,size,used)    {(m)->mark = ((size)|used); BLK_FOOT((m))->mark = (m)->mark;}
+#define BLK_SET(m,size,flags)   {(m)->mark = ((size)|(flags)); \
+                                 if (BLK_FREE((m))) BLK_FOOT((m))->mark = (m)->mark;}
+#define BLK_UPDATE(m,size,flags) BLK_SET((m), (size), (flags) | BLK_PREV_FREE((m)))
 #define BLK_NEXT(m)             ((om_meta *)((uint8_t *)(m) + BLK_SIZE((m))))
 #define BLK_PREV(m)             ((om_meta *)((uint8_t *)(m) - (BLK_SIZE(((om_meta *)((uint8_t *)(m) - META_SIZE))))))
 
+/* Macro's for the size segregated free bins */
+#define BIN_SMALL_NUM           64
+#define BIN_SMALL_MAX           (BIN_SMALL_NUM * ALIGNMENT)
+#define BIN_SMALL_SHIFT         9       /* log2(BIN_SMALL_MAX) */
+#define BIN_MARK(om,i)          ((om)->binmap[(i) / 64] |= (1ULL << ((i) % 64)))
+#define BIN_CLEAR(om,i)         ((om)->binmap[(i) / 64] &= ~(1ULL << ((i) % 64)))
+
+/* Macro's for the lists of minimum sized blocks. The first region's list
+ * is bin TINY_BIN, the lists of any further regions are in om->tiny. */
+#define TINY_BIN                (BLK_MIN_SIZE / ALIGNMENT)
+#define TINY_SHIFT              34      /* 16 GiB regions, reached by 31 bits */
+#define TINY_REGION(om,o)       (((o) - (BLK_BASE(om) - (size_t)(om))) >> TINY_SHIFT)
+#define TINY_REGIONS(om)        (((om)->maxsize >> TINY_SHIFT) + 1)
+
+/* Macro's for buddy mode, where the bins are indexed by block order */
+#define BUDDY_ORDER(size)       (63 - __builtin_clzl(size))
+#define BUDDY_SIZE(size)        (1UL << (64 - __builtin_clzl((size) - 1)))     /* size ≥ 2 */
+#define BUDDY_MIN_SIZE          32      /* Smallest power of 2 ≥ BLK_MIN_SIZE */
+
+/* Macro's for the treap of large free blocks. The priority is a hash of
+ * the offset so it needs no storage and is the same in every process. */
+#define TREE_PRIO(o)            ((uint32_t) (((o) * 0x9E3779B97F4A7C15ULL) >> 32))
+#define TREE_LESS(a,b)          (BLK_SIZE(&(a)->meta) != BLK_SIZE(&(b)->meta) ? \
+                                 BLK_SIZE(&(a)->meta) < BLK_SIZE(&(b)->meta) : (a) < (b))
+
+/* Per-thread caches of recently freed small blocks.
+ * Cached blocks stay marked used and are chained through their payload. */
+#define CACHE_SLOTS             64      /* Threads that may own a cache */
+#define CACHE_CLASSES           32      /* Block sizes cached (24 to 272 bytes) */
+#define CACHE_DEPTH             16      /* Blocks cached per class before flushing */
+#define CACHE_CLASS(size)       (((size) - BLK_MIN_SIZE) / ALIGNMENT)
+#define CACHE_OWNER(pid,tid)    (((uint64_t)(pid) << 32) | (uint32_t)(tid))
+
+typedef struct om_cache {
+    uint64_t owner;
+    uint32_t count[CACHE_CLASSES];
+    offset_t head[CACHE_CLASSES];
+} om_cache;
+
+/* The cache this thread last used */
+static __thread om_block *tcache_om;
+static __thread om_cache *tcache;
+static __thread uint64_t tcache_owner;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Attach time prefaulting is split into slices of at least this many pages */
+#define PREFAULT_THREADS        16
+#define PREFAULT_MIN_PAGES      16384
+
+/* Profiler table entries are found by hashing the offset. Deleted
+ * entries keep an odd offset, which no block payload can have. */
+#define PROF_DELETED            1
+#define PROF_HASH(o)            ((size_t) ((((o) >> 3) * 0x9E3779B97F4A7C15ULL) >> 32))
+
+/* Epoch reader slots take a cache line each so readers do not share */
+typedef struct om_epoch_slot {
+    uint64_t owner;
+    uint64_t epoch;             /* Epoch entered, 0 outside */
+    uint32_t depth;
+    uint8_t pad[44];
+} om_epoch_slot;
+
+/* Blocks waiting for readers are queued outside their payload, which
+ * readers may still be following */
+typedef struct om_deferred {
+    offset_t block;
+    uint64_t epoch;
+} om_deferred;
+
+typedef struct om_epochs {
+    uint64_t epoch;
+    offset_t queue;
+    size_t count;
+    size_t size;
+    uint8_t pad[32];
+    om_epoch_slot slot[OMEPOCH_READERS];
+} om_epochs;
+
+#define EPOCH_QUEUE_MIN         OMEPOCH_BATCH
+
+/* The reader slot this thread last used */
+static __thread om_block *tepoch_om;
+static __thread om_epoch_slot *tepoch;
+
+/* Bytes this thread allocates before its next profiler sample */
+static __thread size_t tprof_left;
+static __thread uint64_t tprof_seed;
+
+/* Pages of a persisted heap are marked in a bitmap as they are written.
+ * The persistence thread wakes every PERSIST_TICK ms. */
+#define DIRTY_SHIFT             12
+#define PERSIST_TICK            10
+
+static inline void dirty_range(om_block * om, const void *p, size_t len)
+{
+    uint64_t *map = omo2p(om, om->dirty);
+    size_t first = ((size_t) p - (size_t) om) >> DIRTY_SHIFT;
+    size_t last = ((size_t) p - (size_t) om + len - 1) >> DIRTY_SHIFT;
+    size_t i;
+
+    for (i = first; i <= last; i++) {
+        uint64_t bit = 1ULL << (i % 64);
+        if (!(__atomic_load_n(&map[i / 64], __ATOMIC_RELAXED) & bit))
+            __atomic_fetch_or(&map[i / 64], bit, __ATOMIC_RELAXED);
+    }
+}
+
+/* A block's header and links, and its footer when free. Tags are
+ * marked where a block settles: as it enters a bin or the tree, and
+ * when it and the block after it are told apart in mark_next(). */
+static inline void dirty_block(om_block * om, om_meta * bp)
+{
+    if (__builtin_expect(om->persister == 0, 1))
+        return;
+    dirty_range(om, bp, BLK_LINKS);
+    if (BLK_FREE(bp))
+        dirty_range(om, BLK_FOOT(bp), META_SIZE);
+}
+
 /* Print a pretty histogram of the block sizes */
-#define HISTOGRAM_NUM_BUCKETS 28
-#define HISTOGRAM_BUCKET_SIZE 8
 void omstats(om_block * om)
 {
-    size_t histogram[HISTOGRAM_NUM_BUCKETS] = { 0 };
-    size_t full = 0;
-    size_t empty = 0;
-    size_t used = 0;
-    size_t free = 0;
+    struct omstats stats;
     size_t max = 0;
     size_t scale = 0;
     size_t max_bucket = 0;
-    size_t min_bucket = HISTOGRAM_NUM_BUCKETS;
+    size_t min_bucket = OMSTATS_CLASSES;
     size_t i, j;
 
-    om_meta *bp = (om_meta *) BLK_BASE(om);
-    while ((size_t) bp < (BLK_BASE(om) + om->size)) {
-        size_t size = BLK_SIZE(bp);
-        if (BLK_FREE(bp)) {
-            free += size;
-            empty++;
-            bp = BLK_NEXT(bp);
+    omstats_get(om, &stats);
+    for (i = 0; i < OMSTATS_CLASSES; i++) {
+        if (!stats.classes[i])
             continue;
-        }
-        int bucket = 0;
-        int power = 1;
-        while (power < size) {
-            power *= 2;
-            bucket++;
-        }
-        histogram[bucket] += 1;
-        used += size;
-        full++;
-        max_bucket = (bucket > max_bucket) ? bucket : max_bucket;
-        min_bucket = (bucket < min_bucket) ? bucket : min_bucket;
-        bp = BLK_NEXT(bp);
-    }
-
-    for (i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
-        max = (histogram[i] > max) ? histogram[i] : max;
+        max = (stats.classes[i] > max) ? stats.classes[i] : max;
+        max_bucket = (i > max_bucket) ? i : max_bucket;
+        min_bucket = (i < min_bucket) ? i : min_bucket;
     }
     scale = (max > 50) ? max / 50 : 1;
 
-    printf("\nHeap size: %zu bytes\n", om->size);
-    printf("Used: %zu blocks (%zu bytes)\n", full, used);
-    printf("Free: %zu blocks (%zu bytes)\n", empty, free);
+    printf("\nHeap size: %zu bytes\n", stats.size);
+    printf("Used: %zu blocks (%zu bytes)\n", stats.used_blocks, stats.used);
+    printf("Free: %zu blocks (%zu bytes)\n", stats.free_blocks, stats.free);
     for (i = min_bucket; i <= max_bucket; i++) {
         printf("%10zu ", 1UL << i);
-        for (j = 0; j < histogram[i] / scale; j++) {
+        for (j = 0; j < stats.classes[i] / scale; j++) {
             putchar('x');
         }
-        if (histogram[i])
-            printf(" (%zu)", histogram[i]);
+        if (stats.classes[i])
+            printf(" (%zu)", stats.classes[i]);
         printf("\n");
     }
 }
@@ -118,171 +272,3023 @@ void omstats(om_block * om)
 /* Return how much memory is still available */
 size_t omavailable(om_block * om)
 {
-    size_t free = 0;
-    if (om) {
-        om_meta *bp = (om_meta *) BLK_BASE(om);
-        while ((size_t) bp < (BLK_BASE(om) + om->size)) {
-            if (BLK_FREE(bp))
-                free += BLK_SIZE(bp);
-            bp = BLK_NEXT(bp);
+    return om ? __atomic_load_n(&om->stats.free, __ATOMIC_RELAXED) : 0;
+}
+
+/* Running totals, kept as blocks move between the bins and use */
+#define STAT_CLASS(size)        (64 - __builtin_clzl((size) - 1))
+
+static inline void stat_used(om_block * om, size_t size, long n)
+{
+    om->stats.used_blocks += n;
+    om->stats.classes[STAT_CLASS(size)] += n;
+}
+
+/* The list a minimum sized block at offset o belongs on */
+static inline offset_t *tiny_head(om_block * om, offset_t o)
+{
+    size_t r = TINY_REGION(om, o);
+
+    return r ? (offset_t *) omo2p(om, om->tiny) + r - 1 : &om->bins[TINY_BIN];
+}
+
+/* Convert between the links of a minimum sized block at offset o and
+ * offsets, which are in the same region */
+static inline offset_t tiny_offset(om_block * om, offset_t o, uint32_t link)
+{
+    offset_t region = BLK_BASE(om) - (size_t) om + (TINY_REGION(om, o) << TINY_SHIFT);
+
+    return link ? region + (size_t) (link - 1) * ALIGNMENT : 0;
+}
+
+static inline uint32_t tiny_link(om_block * om, offset_t o)
+{
+    size_t within = (o - (BLK_BASE(om) - (size_t) om)) & ((1ULL << TINY_SHIFT) - 1);
+
+    return o ? within / ALIGNMENT + 1 : 0;
+}
+
+static inline om_free *free_next(om_block * om, om_free * fb)
+{
+    if (BLK_SIZE(&fb->meta) == BLK_MIN_SIZE)
+        return omo2p(om, tiny_offset(om, omp2o(om, fb), ((om_tiny *) fb)->next));
+    return omo2p(om, fb->next);
+}
+
+/* The first block of bin i, from any region for the minimum size */
+static offset_t bin_first(om_block * om, int i)
+{
+    offset_t *tiny = omo2p(om, om->tiny);
+    size_t r;
+
+    if (om->bins[i] || i != TINY_BIN || !tiny)
+        return om->bins[i];
+    for (r = 0; r < TINY_REGIONS(om) - 1; r++) {
+        if (tiny[r])
+            return tiny[r];
+    }
+    return 0;
+}
+
+/* Find the bin a free block of the given size belongs in */
+static inline int bin_index(size_t size)
+{
+    if (size < BIN_SMALL_MAX)
+        return size / ALIGNMENT;
+    return BIN_SMALL_NUM + (63 - __builtin_clzl(size)) - BIN_SMALL_SHIFT;
+}
+
+/* Split a subtree into the nodes ordered before and after key */
+static void tree_split(om_block * om, offset_t root, om_tree * key, offset_t * l,
+                       offset_t * r)
+{
+    om_tree *t = omo2p(om, root);
+
+    if (!t) {
+        *l = *r = 0;
+    } else if (TREE_LESS(t, key)) {
+        *l = root;
+        tree_split(om, t->right, key, &t->right, r);
+    } else {
+        *r = root;
+        tree_split(om, t->left, key, l, &t->left);
+    }
+}
+
+/* Join two subtrees where every node of l is ordered before r */
+static offset_t tree_join(om_block * om, offset_t l, offset_t r)
+{
+    if (!l || !r)
+        return l ? l : r;
+    if (TREE_PRIO(l) > TREE_PRIO(r)) {
+        om_tree *t = omo2p(om, l);
+        t->right = tree_join(om, t->right, r);
+        return l;
+    } else {
+        om_tree *t = omo2p(om, r);
+        t->left = tree_join(om, l, t->left);
+        return r;
+    }
+}
+
+static offset_t tree_insert(om_block * om, offset_t root, om_tree * node)
+{
+    om_tree *t = omo2p(om, root);
+    offset_t o = omp2o(om, node);
+
+    if (!t || TREE_PRIO(o) > TREE_PRIO(root)) {
+        tree_split(om, root, node, &node->left, &node->right);
+        return o;
+    }
+    if (TREE_LESS(node, t))
+        t->left = tree_insert(om, t->left, node);
+    else
+        t->right = tree_insert(om, t->right, node);
+    return root;
+}
+
+static offset_t tree_remove(om_block * om, offset_t root, om_tree * node)
+{
+    om_tree *t = omo2p(om, root);
+
+    assert(t);
+    if (t == node)
+        return tree_join(om, t->left, t->right);
+    if (TREE_LESS(node, t))
+        t->left = tree_remove(om, t->left, node);
+    else
+        t->right = tree_remove(om, t->right, node);
+    return root;
+}
+
+/* Find the smallest (then lowest) large free block ≥ required size */
+static void *tree_find(om_block * om, size_t size)
+{
+    om_tree *t = omo2p(om, om->tree);
+    om_tree *best = NULL;
+
+    while (t) {
+        if (BLK_SIZE(&t->meta) >= size) {
+            best = t;
+            t = omo2p(om, t->left);
+        } else {
+            t = omo2p(om, t->right);
         }
     }
-    return free;
+    return best;
+}
+
+/* The largest free block is the rightmost in the tree, or failing that
+ * in the highest non-empty bin, which is walked if it holds a range */
+static size_t largest_free(om_block * om)
+{
+    om_tree *t = omo2p(om, om->tree);
+    size_t largest = 0;
+    om_free *fb;
+    int i, w;
+
+    if (t) {
+        while (t->right)
+            t = omo2p(om, t->right);
+        return BLK_SIZE(&t->meta);
+    }
+    for (w = OM_NUM_BINS / 64 - 1; w >= 0 && !om->binmap[w]; w--) ;
+    if (w < 0)
+        return 0;
+    i = w * 64 + 63 - __builtin_clzll(om->binmap[w]);
+    if (om->flags & OM_BUDDY)
+        return 1UL << i;
+    if (i < BIN_SMALL_NUM)
+        return i * ALIGNMENT;
+    for (fb = omo2p(om, om->bins[i]); fb; fb = free_next(om, fb))
+        largest = BLK_SIZE(&fb->meta) > largest ? BLK_SIZE(&fb->meta) : largest;
+    return largest;
+}
+
+/* The largest free block only grows as blocks enter the bins. When it
+ * leaves, finding the next largest is left to omstats_get(), so that
+ * allocation and free never walk a bin for it. */
+#define LARGEST_UNKNOWN         SIZE_MAX
+
+static inline void stat_free(om_block * om, size_t size, long n)
+{
+    om->stats.free += n * size;
+    om->stats.free_blocks += n;
+    if (n > 0 && size > om->stats.largest_free)
+        om->stats.largest_free = size;
+    else if (n < 0 && size == om->stats.largest_free)
+        om->stats.largest_free = LARGEST_UNKNOWN;
+}
+
+/* Add a free block to the head of bin i */
+static void list_push(om_block * om, int i, om_meta * bp)
+{
+    offset_t o = omp2o(om, bp);
+
+    if (BLK_SIZE(bp) == BLK_MIN_SIZE) {
+        om_tiny *tb = (om_tiny *) bp;
+        offset_t *head = tiny_head(om, o);
+
+        tb->prev = 0;
+        tb->next = tiny_link(om, *head);
+        if (*head)
+            ((om_tiny *) omo2p(om, *head))->prev = tiny_link(om, o);
+        *head = o;
+    } else {
+        om_free *fb = (om_free *) bp;
+
+        fb->prev = 0;
+        fb->next = om->bins[i];
+        if (fb->next)
+            ((om_free *) omo2p(om, fb->next))->prev = o;
+        om->bins[i] = o;
+    }
+    BIN_MARK(om, i);
+    stat_free(om, BLK_SIZE(bp), 1);
+    dirty_block(om, bp);
+}
+
+/* Unlink a free block from bin i */
+static void list_unlink(om_block * om, int i, om_meta * bp)
+{
+    offset_t o = omp2o(om, bp);
+
+    if (BLK_SIZE(bp) == BLK_MIN_SIZE) {
+        om_tiny *tb = (om_tiny *) bp;
+        om_tiny *next = omo2p(om, tiny_offset(om, o, tb->next));
+        om_tiny *prev = omo2p(om, tiny_offset(om, o, tb->prev));
+
+        if (prev)
+            prev->next = tb->next;
+        else
+            *tiny_head(om, o) = omp2o(om, next);
+        if (next)
+            next->prev = tb->prev;
+    } else {
+        om_free *fb = (om_free *) bp;
+
+        if (fb->prev)
+            ((om_free *) omo2p(om, fb->prev))->next = fb->next;
+        else
+            om->bins[i] = fb->next;
+        if (fb->next)
+            ((om_free *) omo2p(om, fb->next))->prev = fb->prev;
+    }
+    if (!bin_first(om, i))
+        BIN_CLEAR(om, i);
+    stat_free(om, BLK_SIZE(bp), -1);
+}
+
+/* Add a free block to its bin, or the tree if it is large */
+static void bin_insert(om_block * om, om_meta * bp)
+{
+    if (BLK_SIZE(bp) >= OM_TREE_MIN_SIZE) {
+        om->tree = tree_insert(om, om->tree, (om_tree *) bp);
+        stat_free(om, BLK_SIZE(bp), 1);
+        dirty_block(om, bp);
+    } else {
+        list_push(om, bin_index(BLK_SIZE(bp)), bp);
+    }
+}
+
+static void bin_remove(om_block * om, om_meta * bp)
+{
+    if (BLK_SIZE(bp) >= OM_TREE_MIN_SIZE) {
+        om->tree = tree_remove(om, om->tree, (om_tree *) bp);
+        stat_free(om, BLK_SIZE(bp), -1);
+    } else {
+        list_unlink(om, bin_index(BLK_SIZE(bp)), bp);
+    }
+}
+
+/* Find the first non-empty bin at or above the given index */
+static int bin_next(om_block * om, int i)
+{
+    while (i < OM_NUM_BINS) {
+        uint64_t map = om->binmap[i / 64] >> (i % 64);
+        if (map)
+            return i + __builtin_ctzll(map);
+        i = (i + 64) & ~63;
+    }
+    return -1;
+}
+
+void omstats_get(om_block * om, struct omstats *stats)
+{
+    *stats = om->stats;
+    if (stats->largest_free == LARGEST_UNKNOWN) {
+        omlock(om);
+        if (om->stats.largest_free == LARGEST_UNKNOWN)
+            om->stats.largest_free = largest_free(om);
+        stats->largest_free = om->stats.largest_free;
+        omunlock(om);
+    }
+    stats->size = om->size;
+    stats->used = stats->size - stats->free;
+}
+
+/* Keep the compaction cursor on a block header when the block it
+ * points at is absorbed into the one before */
+static inline void cursor_merged(om_block * om, om_meta * gone, om_meta * into)
+{
+    if (om->compact == omp2o(om, gone))
+        om->compact = omp2o(om, into);
+}
+
+/* Join two adjacent free blocks. The result stays known-zero only if
+ * both halves were, in which case the tags and links between them are
+ * cleared as well. */
+static om_meta *merge(om_block * om, om_meta * bp, om_meta * next)
+{
+    size_t flags = BLK_ZERO(bp) & BLK_ZERO(next);
+    size_t size = BLK_SIZE(bp) + BLK_SIZE(next);
+
+    if (flags)
+        memset((uint8_t *) next - META_SIZE, 0, META_SIZE + BLK_LINKS);
+    BLK_UPDATE(bp, size, flags);
+    cursor_merged(om, next, bp);
+    return bp;
+}
+
+/* Tell the block after bp whether bp is free. Past the end of the heap
+ * this is kept in om->endmark so growth can join a free last block. */
+static void mark_next(om_block * om, om_meta * bp)
+{
+    om_meta *next = BLK_NEXT(bp);
+    size_t *mark = (size_t) next < (BLK_BASE(om) + om->size) ? &next->mark : &om->endmark;
+
+    if (BLK_FREE(bp))
+        *mark |= BLK_F_PREV_FREE;
+    else
+        *mark &= ~(size_t) BLK_F_PREV_FREE;
+    dirty_block(om, bp);
+    if (om->persister && mark != &om->endmark)
+        dirty_range(om, mark, META_SIZE);
 }
 
 /* Given pointer to free block header, coalesce with adjacent blocks and
- * return pointer to coalesced block */
+ * return pointer to coalesced block. The result is not in any bin. */
 static void *coalesce(om_block * om, om_meta * bp)
 {
-    /* Check if there is a previous block */
-    if (BLK_BASE(om) < ((size_t) bp - META_SIZE)) {
+    /* Only a free previous block has a footer to find it by */
+    if (BLK_PREV_FREE(bp)) {
         om_meta *prev = BLK_PREV(bp);
-
-        /* Check if the previous block is free */
-        if (BLK_FREE(prev)) {
-            BLK_SET(prev, BLK_SIZE(prev) + BLK_SIZE(bp), 0);
-            if (om->next == ((size_t) bp - BLK_BASE(om)))
-                om->next = (size_t) prev - BLK_BASE(om);
-            bp = prev;
-        }
+        bin_remove(om, prev);
+        bp = merge(om, prev, bp);
     }
 
     /* Check if there is a next block that is free */
     om_meta *next = BLK_NEXT(bp);
     if ((size_t) next < (BLK_BASE(om) + om->size) && BLK_FREE(next)) {
-        if (om->next == ((size_t) next - BLK_BASE(om)))
-            om->next = (size_t) bp - BLK_BASE(om);
-        BLK_SET(bp, BLK_SIZE(bp) + BLK_SIZE(next), false);
+        bin_remove(om, next);
+        bp = merge(om, bp, next);
     }
+    mark_next(om, bp);
     return bp;
 }
 
-/* Search the heap for a free block ≤ required size */
-static void *find_fit(om_block * om, size_t size)
+/* Return a free block to its order list in buddy mode, merging it with
+ * its buddy for as long as the buddy is free and whole. A block's buddy
+ * is found by flipping the bit of its size in its offset from the base,
+ * so buddy mode has no use for footers or the prev-free bit. */
+static void buddy_release(om_block * om, om_meta * bp)
 {
-    size_t checked = 0;
-    om_meta *bp;
+    size_t size = BLK_SIZE(bp);
+
+    while (true) {
+        size_t off = (size_t) bp - BLK_BASE(om);
+        om_meta *buddy = (om_meta *) (BLK_BASE(om) + (off ^ size));
 
-    bp = (om_meta *) (BLK_BASE(om) + om->next);
-    while (1) {
-        if (checked >= om->size)
+        if ((off ^ size) + size > om->size || BLK_USED(buddy) || BLK_SIZE(buddy) != size)
             break;
-        if ((size_t) bp >= (BLK_BASE(om) + om->size))
-            bp = (om_meta *) BLK_BASE(om);
-        if (BLK_FREE(bp) && BLK_SIZE(bp) >= size)
-            return bp;
-        checked += BLK_SIZE(bp);
-        bp = BLK_NEXT(bp);
+        list_unlink(om, BUDDY_ORDER(size), buddy);
+        bp = buddy < bp ? merge(om, buddy, bp) : merge(om, bp, buddy);
+        size *= 2;
     }
-    return NULL;
+    list_push(om, BUDDY_ORDER(size), bp);
 }
 
-void *omalloc(om_block * om, size_t size)
+/* Hand a fresh zero-filled range of the heap to the buddy lists as the
+ * largest blocks that are aligned to their own size */
+static void buddy_add(om_block * om, size_t start, size_t end)
 {
-    size_t blk_size;
-    om_meta *bp;
+    while (end - start >= BUDDY_MIN_SIZE) {
+        size_t size = 1UL << BUDDY_ORDER(end - start);
+        om_meta *bp = (om_meta *) (BLK_BASE(om) + start);
 
-    if (!size)
-        return 0;
-    blk_size = BLK_ALIGN(size + (2 * META_SIZE));
-    blk_size = blk_size > BLK_MIN_SIZE ? blk_size : BLK_MIN_SIZE;
+        if (start && (start & -start) < size)
+            size = start & -start;
+        BLK_SET(bp, size, BLK_F_ZERO);
+        buddy_release(om, bp);
+        start += size;
+    }
+}
 
-    bp = find_fit(om, blk_size);
-    if (!bp) {
-        assert(bp && "om_block exhausted");
-        return 0;
+/* Take a block of exactly size (a power of 2) in buddy mode, splitting
+ * the smallest larger free block and listing the upper halves */
+static om_meta *buddy_find(om_block * om, size_t size)
+{
+    int i = bin_next(om, BUDDY_ORDER(size));
+    om_meta *bp;
+
+    if (i < 0)
+        return NULL;
+    bp = omo2p(om, om->bins[i]);
+    list_unlink(om, i, bp);
+    while (BLK_SIZE(bp) > size) {
+        size_t half = BLK_SIZE(bp) / 2;
+        om_meta *upper = (om_meta *) ((uint8_t *) bp + half);
+        BLK_SET(upper, half, BLK_ZERO(bp));
+        BLK_SET(bp, half, BLK_ZERO(bp));
+        list_push(om, BUDDY_ORDER(half), upper);
     }
-    om->next = (size_t) bp - BLK_BASE(om);
+    return bp;
+}
 
-    if (blk_size < BLK_SIZE(bp) && (BLK_SIZE(bp) - blk_size) > BLK_MIN_SIZE) {
-        om_meta *next = (om_meta *) ((uint8_t *) bp + blk_size);
-        BLK_SET(next, BLK_SIZE(bp) - blk_size, false);
+/* Search the bins for a free block ≥ required size. A range bin may
+ * hold blocks smaller than required, so only its head is tried before
+ * the binmap gives the next bin up, where any block will fit. The rest
+ * of the range bin is walked only when nothing larger is free. */
+static void *find_fit(om_block * om, size_t size)
+{
+    int i = bin_index(size);
+    om_free *fb;
+    int next;
+
+    if (size >= OM_TREE_MIN_SIZE)
+        return tree_find(om, size);
+    if (i < BIN_SMALL_NUM)
+        next = bin_next(om, i);
+    else if ((fb = omo2p(om, om->bins[i])) && BLK_SIZE(&fb->meta) >= size)
+        return fb;
+    else
+        next = bin_next(om, i + 1);
+    if (next >= 0)
+        return omo2p(om, bin_first(om, next));
+    if ((fb = tree_find(om, size)) != NULL || i < BIN_SMALL_NUM)
+        return fb;
+    for (fb = omo2p(om, om->bins[i]); fb; fb = free_next(om, fb)) {
+        if (BLK_SIZE(&fb->meta) >= size)
+            return fb;
     }
-    BLK_SET(bp, blk_size, true);
+    return NULL;
+}
 
-    VALGRIND_MALLOCLIKE_BLOCK(((uint8_t *) bp + META_SIZE), (blk_size - (2 * META_SIZE)), 0,
-                              0);
-    return (void *) ((uint8_t *) bp + META_SIZE);
+/* Rebuild the free bins and prev-free bits from the block headers,
+ * merging any adjacent free blocks left behind by a writer that died
+ * mid-update */
+static void rebuild_bins(om_block * om)
+{
+    om_meta *bp = (om_meta *) BLK_BASE(om);
+    om_meta *end = (om_meta *) (BLK_BASE(om) + om->size);
+    offset_t *tiny = omo2p(om, om->tiny);
+    size_t prev_free = 0;
+
+    memset(om->binmap, 0, sizeof(om->binmap));
+    memset(om->bins, 0, sizeof(om->bins));
+    if (tiny)
+        memset(tiny, 0, (TINY_REGIONS(om) - 1) * sizeof(offset_t));
+    om->tree = 0;
+    om->compact = 0;
+    memset(&om->stats, 0, sizeof(om->stats));
+    while (bp < end) {
+        om_meta *next = BLK_NEXT(bp);
+        if (BLK_FREE(bp) && (om->flags & OM_BUDDY)) {
+            /* Join free buddies before this block, which are already listed */
+            size_t size = BLK_SIZE(bp);
+            BLK_SET(bp, size, false);
+            while (true) {
+                size_t off = (size_t) bp - BLK_BASE(om);
+                om_meta *buddy = (om_meta *) (BLK_BASE(om) + (off ^ size));
+                if (buddy > bp || BLK_USED(buddy) || BLK_SIZE(buddy) != size)
+                    break;
+                list_unlink(om, BUDDY_ORDER(size), buddy);
+                bp = merge(om, buddy, bp);
+                size *= 2;
+            }
+            list_push(om, BUDDY_ORDER(size), bp);
+        } else if (BLK_FREE(bp)) {
+            while (next < end && BLK_FREE(next))
+                next = BLK_NEXT(next);
+            BLK_SET(bp, (size_t) next - (size_t) bp, false);
+            bin_insert(om, bp);
+        } else {
+            bp->mark = (bp->mark & ~(size_t) BLK_F_PREV_FREE) | prev_free;
+            stat_used(om, BLK_SIZE(bp), 1);
+        }
+        prev_free = BLK_FREE(bp) ? BLK_F_PREV_FREE : 0;
+        bp = next;
+    }
+    om->endmark = prev_free;
 }
 
-void omfree(om_block * om, void *m)
+void omlock(om_block * om)
 {
-    if (m) {
-        VALGRIND_FREELIKE_BLOCK(m, 0);
-        om_meta *bp = (om_meta *) ((uint8_t *) m - META_SIZE);
-        size_t size = BLK_SIZE(bp);
-        VALGRIND_MAKE_MEM_DEFINED(m, (size - (2 * META_SIZE)));
-        BLK_SET(bp, size, false);
-        coalesce(om, bp);
+    int rc;
+
+    if (!(om->flags & OM_LOCKED))
+        return;
+    rc = pthread_mutex_lock(&om->lock);
+    if (rc == EOWNERDEAD) {
+        /* The previous owner died holding the lock */
+        rebuild_bins(om);
+        pthread_mutex_consistent(&om->lock);
+        rc = 0;
     }
+    assert(rc == 0);
 }
 
-om_block *omcreate(const char *fname, size_t rsize, size_t headroom)
+void omunlock(om_block * om)
 {
-    om_block *om = NULL;
-    size_t pgsz = sysconf(_SC_PAGE_SIZE);
-    bool already_init = false;
-    key_t key;
-    int shmid = 0;
-    om_meta *bp;
+    if (om->flags & OM_LOCKED)
+        pthread_mutex_unlock(&om->lock);
+}
+
+/* Process local descriptors of fd backed segments, needed to grow them */
+static GHashTable *om_fds;
+static pthread_mutex_t om_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fd_register(om_block * om, int fd)
+{
+    pthread_mutex_lock(&om_fds_lock);
+    if (!om_fds)
+        om_fds = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(om_fds, om, GINT_TO_POINTER(fd + 1));
+    pthread_mutex_unlock(&om_fds_lock);
+}
+
+static int fd_lookup(om_block * om)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&om_fds_lock);
+    if (om_fds)
+        fd = GPOINTER_TO_INT(g_hash_table_lookup(om_fds, om)) - 1;
+    pthread_mutex_unlock(&om_fds_lock);
+    return fd;
+}
+
+static void fd_unregister(om_block * om)
+{
+    int fd = fd_lookup(om);
+
+    if (fd >= 0) {
+        pthread_mutex_lock(&om_fds_lock);
+        g_hash_table_remove(om_fds, om);
+        pthread_mutex_unlock(&om_fds_lock);
+        close(fd);
+    }
+}
 
+/* Size of the mapping backing a segment */
+static size_t map_size(size_t rsize, size_t headroom, unsigned int flags)
+{
+    size_t pgsz = (flags & OM_HUGETLB) ? OM_HUGEPAGE_SIZE : sysconf(_SC_PAGE_SIZE);
     size_t size = sizeof(om_block) + headroom + rsize;
-    size = (((size) + (pgsz) - 1) & ~((pgsz) - 1));
+    return (((size) + (pgsz) - 1) & ~((pgsz) - 1));
+}
 
-    if (fname != NULL) {
-        key = ftok(fname, 'R');
-        if (key < 0) {
-            perror("ftok");
-            return NULL;
-        }
+/* Touch one byte in every page of a slice of the mapping */
+typedef struct prefault_slice {
+    uint8_t *start;
+    size_t len;
+    size_t pgsz;
+} prefault_slice;
 
-        shmid = shmget(key, size, 0644 | IPC_CREAT | IPC_EXCL);
-        if (shmid < 0) {
-            /* Another process is initializing this memory */
-            shmid = shmget(key, size, 0644);
-            already_init = 1;
-        }
+static void *prefault_slice_run(void *arg)
+{
+    prefault_slice *slice = arg;
+    size_t i;
 
-        om = (om_block *) shmat(shmid, (void *) 0, 0);
-        if (om == (om_block *) (-1)) {
-            perror("shmat");
-            return NULL;
-        }
+    for (i = 0; i < slice->len; i += slice->pgsz)
+        (void) *(volatile uint8_t *) (slice->start + i);
+    return NULL;
+}
 
-        if (already_init) {
-            /* Wait for the other process to finish if required */
-            while (shmid != om->shmid)
-                usleep(10);
-            if (om->size != rsize) {
-                /* Incompatible shared memory segments! */
-                shmdt(om);
-                return NULL;
-            }
-            return om;
-        }
-    } else {
-        om = (om_block *) malloc(size);
+/* Fault in the first len bytes of the mapping, split across threads */
+static void prefault(om_block * om, size_t len, unsigned int flags)
+{
+    prefault_slice slices[PREFAULT_THREADS];
+    pthread_t threads[PREFAULT_THREADS];
+    size_t pgsz = (flags & OM_HUGETLB) ? OM_HUGEPAGE_SIZE : sysconf(_SC_PAGE_SIZE);
+    size_t pages = len / pgsz, n, i, started;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    n = pages / PREFAULT_MIN_PAGES;
+    if (n > (size_t) cpus)
+        n = cpus;
+    if (n > PREFAULT_THREADS)
+        n = PREFAULT_THREADS;
+    if (n < 1)
+        n = 1;
+    for (i = 0; i < n; i++) {
+        slices[i].start = (uint8_t *) om + (pages * i / n) * pgsz;
+        slices[i].len = (pages * (i + 1) / n - pages * i / n) * pgsz;
+        slices[i].pgsz = pgsz;
+    }
+    for (started = 1; started < n; started++) {
+        if (pthread_create(&threads[started], NULL, prefault_slice_run,
+                           &slices[started]) != 0)
+            break;
     }
+    for (i = started; i < n; i++)
+        prefault_slice_run(&slices[i]);
+    prefault_slice_run(&slices[0]);
+    for (i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
 
-    om->shmid = 0;
-    om->size = rsize;
-    om->headroom = headroom;
-    memset((void *) BLK_BASE(om), 0, rsize);
-    bp = (om_meta *) BLK_BASE(om);
-    BLK_SET(bp, rsize, false);
-    om->next = 0;
-    om->shmid = shmid;
-    return om;
+/* Pay for page faults up front as asked by the attach flags. Only the
+ * current heap is touched, growable heaps map space past the backing. */
+static bool warm(om_block * om, unsigned int flags)
+{
+    size_t len = map_size(om->size, om->headroom, om->flags);
+
+    if ((flags & OM_PREFAULT) ||
+        ((flags & OM_POPULATE) && ((om->flags & OM_GROWABLE) || !(om->flags & OM_BACKEND))))
+        prefault(om, len, om->flags);
+    if ((flags & OM_MLOCK) && mlock(om, len) != 0) {
+        perror("mlock");
+        return false;
+    }
+    return true;
 }
 
-void omdestroy(om_block * om)
+/* Extend a growable heap by at least the given number of bytes. The whole
+ * of maxsize is mapped up front, so other processes see the new space as
+ * soon as the backing object has grown. */
+static bool grow(om_block * om, size_t size)
 {
-    if (!om)
-        return;
-    if (om->shmid) {
-        shmdt(om);
+    size_t rsize = om->size;
+    om_meta *bp;
+    int fd;
+
+    if (!(om->flags & OM_GROWABLE))
+        return false;
+
+    /* Double the heap, or more if the request needs it */
+    size = size > rsize ? size : rsize;
+    if (size > om->maxsize - rsize)
+        size = om->maxsize - rsize;
+    size &= ~((om->flags & OM_BUDDY ? BUDDY_MIN_SIZE : ALIGNMENT) - 1);
+    if (size < BLK_MIN_SIZE)
+        return false;
+
+    if (!(om->flags & OM_PRIVATE)) {
+        fd = fd_lookup(om);
+        if (fd < 0 || ftruncate(fd, map_size(rsize + size, om->headroom, om->flags)) < 0)
+            return false;
+    }
+
+    /* The new space is zero-filled by the kernel */
+    if (om->flags & OM_BUDDY) {
+        om->size = rsize + size;
+        buddy_add(om, rsize, rsize + size);
+        return true;
+    }
+    bp = (om_meta *) (BLK_BASE(om) + rsize);
+    BLK_SET(bp, size, BLK_F_ZERO | (om->endmark & BLK_F_PREV_FREE));
+    om->size = rsize + size;
+    bp = coalesce(om, bp);
+    bin_insert(om, bp);
+    return true;
+}
+
+/* Hand out a block already taken from its bin, returning any spare
+ * tail to the heap */
+static void *place(om_block * om, om_meta * bp, size_t blk_size)
+{
+    if (!(om->flags & OM_BUDDY) && (BLK_SIZE(bp) - blk_size) >= BLK_MIN_SIZE) {
+        om_meta *next = (om_meta *) ((uint8_t *) bp + blk_size);
+        BLK_SET(next, BLK_SIZE(bp) - blk_size, BLK_ZERO(bp));
+        bin_insert(om, next);
     } else {
-        free(om);
+        blk_size = BLK_SIZE(bp);
     }
-    return;
+    BLK_UPDATE(bp, blk_size, BLK_F_USED);
+    mark_next(om, bp);
+    stat_used(om, blk_size, 1);
+
+    VALGRIND_MALLOCLIKE_BLOCK(((uint8_t *) bp + META_SIZE), BLK_PAYLOAD(blk_size), 0, 0);
+    return (void *) ((uint8_t *) bp + META_SIZE);
+}
+
+/* Find a free block of at least blk_size bytes, growing the heap if needed */
+static om_meta *take(om_block * om, size_t blk_size)
+{
+    om_meta *bp;
+
+    if (om->flags & OM_BUDDY) {
+        blk_size = BUDDY_SIZE(blk_size);
+        /* New space may need to join old space to hold an aligned block */
+        while ((bp = buddy_find(om, blk_size)) == NULL) {
+            if (!grow(om, blk_size))
+                break;
+        }
+        assert(bp && "om_block exhausted");
+        return bp;
+    }
+    bp = find_fit(om, blk_size);
+    if (!bp && grow(om, blk_size))
+        bp = find_fit(om, blk_size);
+    if (!bp) {
+        assert(bp && "om_block exhausted");
+        return NULL;
+    }
+    bin_remove(om, bp);
+    return bp;
+}
+
+/* Allocate a block, reporting whether its payload beyond the first
+ * BLK_LINKS - META_SIZE bytes and before its last word is known
+ * to be zero */
+static void *_omalloc(om_block * om, size_t size, bool *zero)
+{
+    om_meta *bp = take(om, BLK_REQUEST(size));
+
+    if (!bp)
+        return 0;
+    if (zero)
+        *zero = BLK_ZERO(bp);
+    return place(om, bp, BLK_REQUEST(size));
+}
+
+/* Give the whole pages inside a dirty free block back to the OS and
+ * clear the partial pages at either end, leaving the block known-zero.
+ * Known-zero blocks are fresh or already released, so they are skipped. */
+static void release_block(om_block * om, om_meta * bp)
+{
+    size_t pgsz = (om->flags & OM_HUGETLB) ? OM_HUGEPAGE_SIZE : sysconf(_SC_PAGE_SIZE);
+    uint8_t *start = (uint8_t *) bp + BLK_LINKS;
+    uint8_t *end = (uint8_t *) BLK_FOOT(bp);
+    uint8_t *lo = (uint8_t *) (((size_t) start + pgsz - 1) & ~(pgsz - 1));
+    uint8_t *hi = (uint8_t *) ((size_t) end & ~(pgsz - 1));
+    int advice = (om->flags & OM_PRIVATE) ? MADV_DONTNEED : MADV_REMOVE;
+
+    if (BLK_ZERO(bp) || hi <= lo)
+        return;
+    if (madvise(lo, hi - lo, advice) != 0) {
+        /* The backing cannot drop pages, stop trying */
+        om->release = 0;
+        return;
+    }
+    memset(start, 0, lo - start);
+    memset(hi, 0, end - hi);
+    BLK_UPDATE(bp, BLK_SIZE(bp), BLK_F_ZERO);
+}
+
+static void release_tree(om_block * om, offset_t node)
+{
+    om_tree *t = omo2p(om, node);
+
+    if (t) {
+        release_tree(om, t->left);
+        release_tree(om, t->right);
+        release_block(om, &t->meta);
+    }
+}
+
+/* Count bytes freed and once enough have been freed since the last pass,
+ * release every free block of at least OM_TREE_MIN_SIZE */
+static void release_account(om_block * om, size_t size)
+{
+    size_t i;
+
+    if (!om->release || (om->unreleased += size) < om->release)
+        return;
+    om->unreleased = 0;
+    if (!(om->flags & OM_BUDDY)) {
+        release_tree(om, om->tree);
+        return;
+    }
+    for (i = BUDDY_ORDER(OM_TREE_MIN_SIZE); i < OM_NUM_BINS && om->release; i++) {
+        om_free *fp = omo2p(om, om->bins[i]);
+        for (; fp && om->release; fp = free_next(om, fp))
+            release_block(om, &fp->meta);
+    }
+}
+
+/* Find the table entry for a block, or where to insert it */
+static omsample *profile_slot(omprofile * prof, offset_t offset, bool insert)
+{
+    omsample *deleted = NULL;
+    size_t i = PROF_HASH(offset) % prof->count;
+    size_t n;
+
+    for (n = 0; n < prof->count; n++, i = (i + 1) % prof->count) {
+        omsample *s = &prof->sample[i];
+        if (s->offset == offset)
+            return s;
+        if (s->offset == 0)
+            return insert ? (deleted ? deleted : s) : NULL;
+        if (s->offset == PROF_DELETED && !deleted)
+            deleted = s;
+    }
+    return insert ? deleted : NULL;
+}
+
+/* Remove a block that is about to be freed from the profiler table */
+static void profile_free(om_block * om, void *m)
+{
+    om_meta *bp = (om_meta *) ((uint8_t *) m - META_SIZE);
+    omprofile *prof;
+    omsample *s;
+
+    if (!BLK_SAMPLED(bp))
+        return;
+    omlock(om);
+    bp->mark &= ~(size_t) BLK_F_SAMPLED;
+    prof = omo2p(om, om->profile);
+    if (prof && (s = profile_slot(prof, omp2o(om, m), false)) != NULL) {
+        s->offset = PROF_DELETED;
+        prof->live--;
+    }
+    omunlock(om);
+}
+
+static void _omfree(om_block * om, void *m)
+{
+    VALGRIND_FREELIKE_BLOCK(m, 0);
+    om_meta *bp = (om_meta *) ((uint8_t *) m - META_SIZE);
+    size_t size = BLK_SIZE(bp);
+    VALGRIND_MAKE_MEM_DEFINED(m, BLK_PAYLOAD(size));
+    if (__builtin_expect(BLK_SAMPLED(bp), 0))
+        profile_free(om, m);
+    stat_used(om, size, -1);
+    BLK_UPDATE(bp, size, false);
+    if (om->flags & OM_BUDDY) {
+        buddy_release(om, bp);
+    } else {
+        bp = coalesce(om, bp);
+        bin_insert(om, bp);
+    }
+    release_account(om, size);
+}
+
+/* A forked child must not share its parent's cache */
+static void cache_atfork_child(void)
+{
+    tcache_om = NULL;
+    tcache = NULL;
+    tcache_owner = 0;
+    tepoch_om = NULL;
+    tepoch = NULL;
+}
+
+static void cache_atfork(void)
+{
+    pthread_atfork(NULL, NULL, cache_atfork_child);
+}
+
+static bool cache_owner_dead(uint64_t owner)
+{
+    return owner && syscall(SYS_tgkill, (pid_t) (owner >> 32), (pid_t) (owner & 0xffffffff),
+                            0) < 0 && errno == ESRCH;
+}
+
+/* Return every block held in a cache to the heap */
+static void cache_drain(om_block * om, om_cache * cache, int class, uint32_t keep)
+{
+    while (cache->count[class] > keep) {
+        void *m = omo2p(om, cache->head[class]);
+        cache->head[class] = *(offset_t *) m;
+        cache->count[class]--;
+        _omfree(om, m);
+    }
+}
+
+static void cache_drain_all(om_block * om, om_cache * cache)
+{
+    int i;
+
+    omlock(om);
+    for (i = 0; i < CACHE_CLASSES; i++)
+        cache_drain(om, cache, i, 0);
+    omunlock(om);
+}
+
+/* Find or claim the calling thread's cache slot */
+static om_cache *cache_get(om_block * om)
+{
+    om_cache *caches;
+    uint64_t owner;
+    int i;
+
+    if (tcache_om == om)
+        return tcache;
+
+    pthread_once(&tcache_once, cache_atfork);
+    if (!tcache_owner)
+        tcache_owner = CACHE_OWNER(getpid(), syscall(SYS_gettid));
+    caches = omo2p(om, om->caches);
+
+    for (i = 0; i < CACHE_SLOTS; i++) {
+        if (caches[i].owner == tcache_owner)
+            goto found;
+    }
+    for (i = 0; i < CACHE_SLOTS; i++) {
+        owner = 0;
+        if (__atomic_compare_exchange_n(&caches[i].owner, &owner, tcache_owner, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            goto found;
+    }
+    for (i = 0; i < CACHE_SLOTS; i++) {
+        owner = caches[i].owner;
+        if (cache_owner_dead(owner) &&
+            __atomic_compare_exchange_n(&caches[i].owner, &owner, tcache_owner, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            cache_drain_all(om, &caches[i]);
+            goto found;
+        }
+    }
+    return NULL;
+
+  found:
+    tcache_om = om;
+    tcache = &caches[i];
+    return tcache;
+}
+
+static void *cache_alloc(om_block * om, size_t size)
+{
+    size_t blk_size = BLK_REQUEST(size);
+    size_t class = CACHE_CLASS((om->flags & OM_BUDDY) ? BUDDY_SIZE(blk_size) : blk_size);
+    om_cache *cache;
+    void *m;
+
+    if (class >= CACHE_CLASSES || (cache = cache_get(om)) == NULL || !cache->count[class])
+        return NULL;
+    m = omo2p(om, cache->head[class]);
+    cache->head[class] = *(offset_t *) m;
+    cache->count[class]--;
+    VALGRIND_MALLOCLIKE_BLOCK(m,
+                              BLK_PAYLOAD(BLK_SIZE((om_meta *) ((uint8_t *) m - META_SIZE))),
+                              0, 0);
+    return m;
+}
+
+static bool cache_free(om_block * om, void *m)
+{
+    om_meta *bp = (om_meta *) ((uint8_t *) m - META_SIZE);
+    size_t class = CACHE_CLASS(BLK_SIZE(bp));
+    om_cache *cache;
+
+    if (class >= CACHE_CLASSES || (cache = cache_get(om)) == NULL)
+        return false;
+    VALGRIND_FREELIKE_BLOCK(m, 0);
+    VALGRIND_MAKE_MEM_DEFINED(m, sizeof(offset_t));
+    *(offset_t *) m = cache->head[class];
+    cache->head[class] = omp2o(om, m);
+    if (++cache->count[class] > CACHE_DEPTH) {
+        /* Return the older half to the heap */
+        offset_t *link = (offset_t *) m;
+        uint32_t i;
+        for (i = 1; i < CACHE_DEPTH / 2; i++)
+            link = omo2p(om, *link);
+        omlock(om);
+        while (*link) {
+            void *old = omo2p(om, *link);
+            *link = *(offset_t *) old;
+            _omfree(om, old);
+        }
+        omunlock(om);
+        cache->count[class] = CACHE_DEPTH / 2;
+    }
+    return true;
+}
+
+void omcache_flush(om_block * om)
+{
+    om_cache *cache;
+
+    if (!(om->flags & OM_CACHED) || (cache = cache_get(om)) == NULL)
+        return;
+    cache_drain_all(om, cache);
+    __atomic_store_n(&cache->owner, 0, __ATOMIC_RELEASE);
+    tcache_om = NULL;
+    tcache = NULL;
+}
+
+/* Move the live samples to a new table of count entries, clearing
+ * deleted entries. Samples that no longer fit are dropped. */
+static omprofile *profile_resize(om_block * om, size_t count)
+{
+    omprofile *old = omo2p(om, om->profile);
+    omprofile *prof;
+    size_t i;
+
+    prof = _omalloc(om, sizeof(omprofile) + count * sizeof(omsample), NULL);
+    if (!prof)
+        return NULL;
+    memset(prof, 0, sizeof(omprofile) + count * sizeof(omsample));
+    prof->count = count;
+    if (old) {
+        prof->interval = old->interval;
+        prof->dropped = old->dropped;
+        for (i = 0; i < old->count; i++) {
+            omsample *s = &old->sample[i], *to;
+            if (!s->offset || s->offset == PROF_DELETED)
+                continue;
+            to = prof->live < count * 3 / 4 ? profile_slot(prof, s->offset, true) : NULL;
+            if (!to) {
+                om_meta *bp = (om_meta *) ((uint8_t *) omo2p(om, s->offset) - META_SIZE);
+                bp->mark &= ~(size_t) BLK_F_SAMPLED;
+                prof->dropped++;
+                continue;
+            }
+            *to = *s;
+            prof->live++;
+            prof->used++;
+        }
+        _omfree(om, old);
+    }
+    om->profile = omp2o(om, prof);
+    return prof;
+}
+
+/* Carry the sample of a block that moves over to its new payload
+ * offset, returning false if the profiler no longer has it */
+static bool profile_move(om_block * om, offset_t from, offset_t to)
+{
+    omprofile *prof = omo2p(om, om->profile);
+    omsample *s, *t, moved;
+
+    if (!prof || (s = profile_slot(prof, from, false)) == NULL)
+        return false;
+    moved = *s;
+    s->offset = PROF_DELETED;
+    /* The slot just deleted is free if nothing nearer is */
+    t = profile_slot(prof, to, true);
+    if (t->offset == 0)
+        prof->used++;
+    *t = moved;
+    t->offset = to;
+    return true;
+}
+
+/* Count down the bytes to this thread's next sample, and on reaching it
+ * record the caller's stack. The frames of this function and the public
+ * entry point are skipped. */
+static void __attribute__ ((noinline)) profile_alloc(om_block * om, void *m, size_t size)
+{
+    size_t interval = __atomic_load_n(&om->sampling, __ATOMIC_RELAXED);
+    void *stack[OMPROFILE_DEPTH + 2];
+    omprofile *prof;
+    omsample *s;
+    om_meta *bp;
+    int depth, i;
+
+    if (!m || !interval)
+        return;
+    if (tprof_left > size) {
+        tprof_left -= size;
+        return;
+    }
+    /* Exponentially distributed gaps sample every byte with equal chance
+     * and do not alias with periodic allocation patterns */
+    tprof_seed = tprof_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    tprof_left = -log(((tprof_seed >> 11) + 1) * 0x1.0p-53) * interval;
+    depth = backtrace(stack, OMPROFILE_DEPTH + 2) - 2;
+    if (depth < 0)
+        depth = 0;
+
+    omlock(om);
+    prof = omo2p(om, om->profile);
+    if (prof && prof->used >= prof->count * 3 / 4 && prof->live < prof->count / 2)
+        prof = profile_resize(om, prof->count);
+    if (!prof) {
+        omunlock(om);
+        return;
+    }
+    s = profile_slot(prof, omp2o(om, m), true);
+    if (!s || prof->live >= prof->count * 3 / 4) {
+        prof->dropped++;
+        omunlock(om);
+        return;
+    }
+    if (s->offset != omp2o(om, m)) {
+        if (s->offset == 0)
+            prof->used++;
+        prof->live++;
+    }
+    s->offset = omp2o(om, m);
+    s->size = size;
+    s->pid = getpid();
+    s->depth = depth;
+    for (i = 0; i < depth; i++)
+        s->stack[i] = (uintptr_t) stack[i + 2];
+    bp = (om_meta *) ((uint8_t *) m - META_SIZE);
+    bp->mark |= BLK_F_SAMPLED;
+    omunlock(om);
+}
+
+bool omprofile_start(om_block * om, size_t interval, size_t samples)
+{
+    omprofile *prof;
+
+    if (!interval)
+        return false;
+    if (!samples)
+        samples = OMPROFILE_SAMPLES;
+    omlock(om);
+    prof = omo2p(om, om->profile);
+    if (!prof || prof->count != samples)
+        prof = profile_resize(om, samples);
+    if (prof) {
+        prof->interval = interval;
+        __atomic_store_n(&om->sampling, interval, __ATOMIC_RELAXED);
+    }
+    omunlock(om);
+    return prof != NULL;
+}
+
+void omprofile_stop(om_block * om)
+{
+    omprofile *prof;
+    size_t i;
+
+    omlock(om);
+    __atomic_store_n(&om->sampling, 0, __ATOMIC_RELAXED);
+    prof = omo2p(om, om->profile);
+    if (prof) {
+        /* Blocks freed from now on are not looked for in the table */
+        for (i = 0; i < prof->count; i++) {
+            omsample *s = &prof->sample[i];
+            if (s->offset && s->offset != PROF_DELETED) {
+                om_meta *bp = (om_meta *) ((uint8_t *) omo2p(om, s->offset) - META_SIZE);
+                bp->mark &= ~(size_t) BLK_F_SAMPLED;
+            }
+        }
+        _omfree(om, prof);
+        om->profile = 0;
+    }
+    omunlock(om);
+}
+
+/* The reader table is allocated on first use, which only the heap lock
+ * keeps apart from other allocations */
+static om_epochs *epochs_get(om_block * om)
+{
+    om_epochs *e = omo2p(om, __atomic_load_n(&om->epochs, __ATOMIC_ACQUIRE));
+
+    if (e || !(om->flags & OM_LOCKED))
+        return e;
+    omlock(om);
+    if (!om->epochs) {
+        e = _omalloc(om, sizeof(om_epochs), NULL);
+        if (e) {
+            memset(e, 0, sizeof(om_epochs));
+            e->epoch = 1;
+            __atomic_store_n(&om->epochs, omp2o(om, e), __ATOMIC_RELEASE);
+        }
+    }
+    omunlock(om);
+    return omo2p(om, om->epochs);
+}
+
+/* Find or claim the calling thread's reader slot */
+static om_epoch_slot *epoch_slot(om_block * om)
+{
+    om_epochs *e;
+    uint64_t owner;
+    int i;
+
+    if (tepoch_om == om)
+        return tepoch;
+    if ((e = epochs_get(om)) == NULL)
+        return NULL;
+
+    pthread_once(&tcache_once, cache_atfork);
+    if (!tcache_owner)
+        tcache_owner = CACHE_OWNER(getpid(), syscall(SYS_gettid));
+    for (i = 0; i < OMEPOCH_READERS; i++) {
+        if (e->slot[i].owner == tcache_owner)
+            goto found;
+    }
+    for (i = 0; i < OMEPOCH_READERS; i++) {
+        owner = e->slot[i].owner;
+        if ((!owner || cache_owner_dead(owner)) &&
+            __atomic_compare_exchange_n(&e->slot[i].owner, &owner, tcache_owner, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            e->slot[i].depth = 0;
+            __atomic_store_n(&e->slot[i].epoch, 0, __ATOMIC_RELEASE);
+            goto found;
+        }
+    }
+    return NULL;
+
+  found:
+    tepoch_om = om;
+    tepoch = &e->slot[i];
+    return tepoch;
+}
+
+/* A reader may hold on to the epoch it read before announcing it, which
+ * only makes it look older than it is */
+bool omepoch_enter(om_block * om)
+{
+    om_epoch_slot *s = epoch_slot(om);
+    om_epochs *e;
+
+    if (!s)
+        return false;
+    if (s->depth++)
+        return true;
+    e = omo2p(om, om->epochs);
+    __atomic_store_n(&s->epoch, __atomic_load_n(&e->epoch, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return true;
+}
+
+void omepoch_exit(om_block * om)
+{
+    om_epoch_slot *s = epoch_slot(om);
+
+    if (s && s->depth && --s->depth == 0)
+        __atomic_store_n(&s->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Free the queued blocks no reader can still reach, moving the epoch on
+ * once every reader has entered the current one */
+static size_t epoch_reclaim(om_block * om, om_epochs * e)
+{
+    om_deferred *q = omo2p(om, e->queue);
+    uint64_t epoch = e->epoch, oldest = UINT64_MAX;
+    size_t i, n = 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < OMEPOCH_READERS; i++) {
+        om_epoch_slot *s = &e->slot[i];
+        uint64_t entered = __atomic_load_n(&s->epoch, __ATOMIC_ACQUIRE);
+
+        if (!entered)
+            continue;
+        if (cache_owner_dead(s->owner)) {
+            /* The reader died inside */
+            __atomic_store_n(&s->epoch, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        oldest = entered < oldest ? entered : oldest;
+    }
+    if (oldest == UINT64_MAX || oldest == epoch)
+        __atomic_store_n(&e->epoch, ++epoch, __ATOMIC_SEQ_CST);
+    if (oldest == UINT64_MAX)
+        oldest = epoch;
+
+    for (i = 0; i < e->count; i++) {
+        if (q[i].epoch < oldest) {
+            omfree(om, omo2p(om, q[i].block));
+            n++;
+        } else {
+            q[i - n] = q[i];
+        }
+    }
+    e->count -= n;
+    return n;
+}
+
+bool omfree_deferred(om_block * om, void *m)
+{
+    om_epochs *e;
+    om_deferred *q;
+
+    if (!m)
+        return true;
+    if (!(om->flags & OM_LOCKED))
+        return false;
+    if ((e = epochs_get(om)) == NULL) {
+        assert(e && "om_block exhausted");
+        return false;
+    }
+    omlock(om);
+    if (e->count == e->size)
+        epoch_reclaim(om, e);
+    q = omo2p(om, e->queue);
+    if (e->count == e->size) {
+        size_t size = e->size ? e->size * 2 : EPOCH_QUEUE_MIN;
+        om_deferred *grown = _omalloc(om, size * sizeof(om_deferred), NULL);
+
+        assert(grown && "om_block exhausted");
+        if (!grown) {
+            omunlock(om);
+            return false;
+        }
+        if (q) {
+            memcpy(grown, q, e->count * sizeof(om_deferred));
+            _omfree(om, q);
+        }
+        q = grown;
+        e->queue = omp2o(om, q);
+        e->size = size;
+    }
+    /* The block was unlinked before its epoch is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    q[e->count].block = omp2o(om, m);
+    q[e->count++].epoch = __atomic_load_n(&e->epoch, __ATOMIC_RELAXED);
+    if (e->count % OMEPOCH_BATCH == 0)
+        epoch_reclaim(om, e);
+    omunlock(om);
+    return true;
+}
+
+size_t omepoch_reclaim(om_block * om)
+{
+    om_epochs *e = omo2p(om, om->epochs);
+    size_t n;
+
+    if (!e)
+        return 0;
+    omlock(om);
+    n = epoch_reclaim(om, e);
+    omunlock(om);
+    return n;
+}
+
+void *omalloc(om_block * om, size_t size)
+{
+    void *m = NULL;
+
+    if (!size)
+        return 0;
+    if (om->flags & OM_CACHED)
+        m = cache_alloc(om, size);
+    if (!m) {
+        omlock(om);
+        m = _omalloc(om, size, NULL);
+        omunlock(om);
+    }
+    if (__builtin_expect(om->sampling != 0, 0))
+        profile_alloc(om, m, size);
+    return m;
+}
+
+size_t omalloc_bulk(om_block * om, size_t size, size_t n, void **out)
+{
+    size_t blk_size, done = 0;
+    om_meta *bp;
+
+    if (!size || !n)
+        return 0;
+    blk_size = BLK_REQUEST(size);
+
+    omlock(om);
+    while (done < n) {
+        size_t count = n - done;
+
+        /* Prefer one span that holds everything that is left */
+        bp = NULL;
+        if (!(om->flags & OM_BUDDY) && count > 1 && count <= SIZE_MAX / blk_size)
+            bp = find_fit(om, blk_size * count);
+        if (bp)
+            bin_remove(om, bp);
+        else if ((bp = take(om, blk_size)) == NULL)
+            break;
+        if (count > BLK_SIZE(bp) / blk_size)
+            count = BLK_SIZE(bp) / blk_size;
+
+        /* Carve the span front to back, the last block takes the tail */
+        while (--count) {
+            om_meta *next = (om_meta *) ((uint8_t *) bp + blk_size);
+            BLK_SET(next, BLK_SIZE(bp) - blk_size, 0);
+            BLK_UPDATE(bp, blk_size, BLK_F_USED);
+            dirty_block(om, bp);
+            stat_used(om, blk_size, 1);
+            VALGRIND_MALLOCLIKE_BLOCK(((uint8_t *) bp + META_SIZE), BLK_PAYLOAD(blk_size),
+                                      0, 0);
+            out[done++] = (uint8_t *) bp + META_SIZE;
+            bp = next;
+        }
+        out[done++] = place(om, bp, blk_size);
+    }
+    omunlock(om);
+    if (__builtin_expect(om->sampling != 0, 0)) {
+        size_t i;
+        for (i = 0; i < done; i++)
+            profile_alloc(om, out[i], size);
+    }
+    return done;
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t pa = *(const uintptr_t *) a;
+    uintptr_t pb = *(const uintptr_t *) b;
+    return (pa > pb) - (pa < pb);
+}
+
+void omfree_bulk(om_block * om, void **ptrs, size_t n)
+{
+    void **sorted;
+    size_t i = 0;
+
+    if (!n)
+        return;
+    if (__builtin_expect(om->sampling != 0, 0)) {
+        for (i = 0; i < n; i++) {
+            if (ptrs[i])
+                profile_free(om, ptrs[i]);
+        }
+        i = 0;
+    }
+    /* Runs of neighbours are not buddies, and without room for a sorted
+     * copy the blocks are freed in the order given */
+    sorted = (om->flags & OM_BUDDY) ? NULL : malloc(n * sizeof(void *));
+    if (!sorted) {
+        omlock(om);
+        for (i = 0; i < n; i++) {
+            if (ptrs[i])
+                _omfree(om, ptrs[i]);
+        }
+        omunlock(om);
+        return;
+    }
+    memcpy(sorted, ptrs, n * sizeof(void *));
+    qsort(sorted, n, sizeof(void *), ptr_cmp);
+
+    /* Free in address order, joining runs of neighbours before
+     * coalescing and binning each run once */
+    omlock(om);
+    while (i < n && !sorted[i])
+        i++;
+    while (i < n) {
+        om_meta *bp = (om_meta *) ((uint8_t *) sorted[i] - META_SIZE);
+        size_t size = BLK_SIZE(bp);
+
+        VALGRIND_FREELIKE_BLOCK(sorted[i], 0);
+        stat_used(om, size, -1);
+        for (i++; i < n && (uint8_t *) sorted[i] - META_SIZE == (uint8_t *) bp + size; i++) {
+            om_meta *run = (om_meta *) ((uint8_t *) sorted[i] - META_SIZE);
+            VALGRIND_FREELIKE_BLOCK(sorted[i], 0);
+            cursor_merged(om, run, bp);
+            stat_used(om, BLK_SIZE(run), -1);
+            size += BLK_SIZE(run);
+        }
+        VALGRIND_MAKE_MEM_DEFINED((uint8_t *) bp + META_SIZE, BLK_PAYLOAD(size));
+        BLK_UPDATE(bp, size, false);
+        bp = coalesce(om, bp);
+        bin_insert(om, bp);
+        release_account(om, size);
+    }
+    omunlock(om);
+    free(sorted);
+}
+
+void *omalloc_aligned(om_block * om, size_t size, size_t align)
+{
+    size_t blk_size, pad;
+    om_meta *bp;
+    void *m;
+
+    if (!size || !align || (align & (align - 1)))
+        return 0;
+    if (align <= ALIGNMENT)
+        return omalloc(om, size);
+    if (om->flags & OM_BUDDY)
+        return 0;
+    blk_size = BLK_REQUEST(size);
+
+    omlock(om);
+    bp = take(om, blk_size + align + BLK_MIN_SIZE);
+    if (!bp) {
+        omunlock(om);
+        return 0;
+    }
+
+    /* Split off leading padding, which must be big enough to be a block */
+    m = (uint8_t *) bp + META_SIZE;
+    pad = (align - ((size_t) m & (align - 1))) & (align - 1);
+    while (pad && pad < BLK_MIN_SIZE)
+        pad += align;
+    if (pad) {
+        om_meta *next = (om_meta *) ((uint8_t *) bp + pad);
+        BLK_SET(next, BLK_SIZE(bp) - pad, BLK_ZERO(bp) | BLK_F_PREV_FREE);
+        BLK_UPDATE(bp, pad, BLK_ZERO(bp));
+        bin_insert(om, bp);
+        bp = next;
+    }
+    m = place(om, bp, blk_size);
+    omunlock(om);
+    if (__builtin_expect(om->sampling != 0, 0))
+        profile_alloc(om, m, size);
+    return m;
+}
+
+void *omcalloc(om_block * om, size_t nmemb, size_t size)
+{
+    bool zero = false;
+    void *m = NULL;
+
+    if (!nmemb || !size || nmemb > SIZE_MAX / size)
+        return 0;
+    size *= nmemb;
+    if (om->flags & OM_CACHED)
+        m = cache_alloc(om, size);
+    if (!m) {
+        omlock(om);
+        m = _omalloc(om, size, &zero);
+        omunlock(om);
+    }
+    if (__builtin_expect(om->sampling != 0, 0))
+        profile_alloc(om, m, size);
+    if (m && zero) {
+        /* Known-zero blocks only need their free list links and any
+         * footer left in their last word cleared */
+        om_meta *bp = (om_meta *) ((uint8_t *) m - META_SIZE);
+        uint8_t *foot = (uint8_t *) BLK_FOOT(bp);
+        if (foot < (uint8_t *) m + size)
+            memset(foot, 0, META_SIZE);
+        if (size > BLK_LINKS - META_SIZE)
+            size = BLK_LINKS - META_SIZE;
+        memset(m, 0, size);
+    } else if (m) {
+        memset(m, 0, size);
+    }
+    return m;
+}
+
+void omfree(om_block * om, void *m)
+{
+    if (m) {
+        if (__builtin_expect(om->sampling != 0, 0))
+            profile_free(om, m);
+        if ((om->flags & OM_CACHED) && cache_free(om, m))
+            return;
+        omlock(om);
+        _omfree(om, m);
+        omunlock(om);
+    }
+}
+
+void *omrealloc(om_block * om, void *m, size_t size)
+{
+    om_meta *bp, *next;
+    size_t blk_size, size_old, size_cur;
+    void *n;
+
+    if (!m)
+        return omalloc(om, size);
+    if (!size) {
+        omfree(om, m);
+        return NULL;
+    }
+    bp = (om_meta *) ((uint8_t *) m - META_SIZE);
+    blk_size = BLK_REQUEST(size);
+    if (__builtin_expect(om->sampling != 0, 0))
+        profile_free(om, m);
+
+    omlock(om);
+    size_old = size_cur = BLK_SIZE(bp);
+    if (om->flags & OM_BUDDY)
+        blk_size = BUDDY_SIZE(blk_size);
+    if (blk_size > size_cur) {
+        /* Grow into the following block if it is free and big enough */
+        next = BLK_NEXT(bp);
+        if ((om->flags & OM_BUDDY) || (size_t) next >= (BLK_BASE(om) + om->size) ||
+            BLK_USED(next) || size_cur + BLK_SIZE(next) < blk_size) {
+            n = _omalloc(om, size, NULL);
+            if (n) {
+                memcpy(n, m, BLK_PAYLOAD(size_cur));
+                _omfree(om, m);
+            }
+            omunlock(om);
+            if (__builtin_expect(om->sampling != 0, 0))
+                profile_alloc(om, n, size);
+            return n;
+        }
+        bin_remove(om, next);
+        cursor_merged(om, next, bp);
+        size_cur += BLK_SIZE(next);
+        BLK_UPDATE(bp, size_cur, BLK_F_USED);
+        mark_next(om, bp);
+    }
+
+    /* Return any spare tail to the heap, as whole upper halves for buddies */
+    if (om->flags & OM_BUDDY) {
+        while (size_cur > blk_size) {
+            size_cur /= 2;
+            BLK_UPDATE(bp, size_cur, BLK_F_USED);
+            next = BLK_NEXT(bp);
+            BLK_SET(next, size_cur, false);
+            buddy_release(om, next);
+        }
+    } else if ((size_cur - blk_size) >= BLK_MIN_SIZE) {
+        BLK_UPDATE(bp, blk_size, BLK_F_USED);
+        next = BLK_NEXT(bp);
+        BLK_SET(next, size_cur - blk_size, 0);
+        next = coalesce(om, next);
+        bin_insert(om, next);
+        size_cur = blk_size;
+    }
+    if (size_cur != size_old) {
+        stat_used(om, size_old, -1);
+        stat_used(om, size_cur, 1);
+        dirty_block(om, bp);
+    }
+    omunlock(om);
+    VALGRIND_RESIZEINPLACE_BLOCK(m, BLK_PAYLOAD(size_old), BLK_PAYLOAD(size_cur), 0);
+    if (__builtin_expect(om->sampling != 0, 0))
+        profile_alloc(om, m, size);
+    return m;
+}
+
+omhandle omhalloc(om_block * om, size_t size)
+{
+    om_handles *table;
+    omhandle h, *m;
+
+    if (!size)
+        return 0;
+    omlock(om);
+    table = omo2p(om, om->handles);
+    if (!table || !table->free) {
+        /* Double the table, entry 0 is never handed out */
+        size_t count = table ? table->count * 2 : 64;
+        size_t i = table ? table->count : 1;
+        size_t used = table ? table->used : 0;
+        om_handles *old = table;
+
+        table = _omalloc(om, sizeof(om_handles) + count * sizeof(offset_t), NULL);
+        if (!table) {
+            omunlock(om);
+            return 0;
+        }
+        if (old) {
+            memcpy(table->entry, old->entry, old->count * sizeof(offset_t));
+            _omfree(om, old);
+        }
+        table->count = count;
+        table->used = used;
+        table->free = i;
+        for (; i < count; i++)
+            table->entry[i] = HANDLE_FREE(i + 1 < count ? i + 1 : 0);
+        om->handles = omp2o(om, table);
+    }
+    h = 0;
+    if ((m = _omalloc(om, sizeof(omhandle) + size, NULL)) != NULL) {
+        h = table->free;
+        table->free = table->entry[h] >> 1;
+        table->entry[h] = omp2o(om, (m + 1));
+        table->used++;
+        *m = h;
+    }
+    omunlock(om);
+    return h;
+}
+
+void *omhptr(om_block * om, omhandle h)
+{
+    om_handles *table = omo2p(om, om->handles);
+
+    if (!table || !h || h >= table->count || (table->entry[h] & 1))
+        return NULL;
+    return omo2p(om, table->entry[h]);
+}
+
+void omhfree(om_block * om, omhandle h)
+{
+    om_handles *table;
+    void *m;
+
+    omlock(om);
+    if ((m = omhptr(om, h)) != NULL) {
+        table = omo2p(om, om->handles);
+        _omfree(om, (omhandle *) m - 1);
+        table->entry[h] = HANDLE_FREE(table->free);
+        table->free = h;
+        if (!--table->used) {
+            /* Give back the table with the last handle */
+            om->handles = 0;
+            _omfree(om, table);
+        }
+    }
+    omunlock(om);
+}
+
+/* A used block belongs to a handle if the id in its first word
+ * maps back to it */
+static bool movable(om_block * om, om_handles * table, om_meta * bp)
+{
+    omhandle *h = (omhandle *) ((uint8_t *) bp + META_SIZE);
+
+    return BLK_USED(bp) && *h && *h < table->count &&
+        table->entry[*h] == omp2o(om, (h + 1));
+}
+
+/* Slide the movable block after free block bp down into its place,
+ * returning the free space left behind it */
+static om_meta *slide(om_block * om, om_handles * table, om_meta * bp, om_meta * next)
+{
+    size_t free = BLK_SIZE(bp);
+    size_t size = BLK_SIZE(next);
+    size_t prev_free = BLK_PREV_FREE(bp);
+    size_t sampled = 0;
+    omhandle *h;
+
+    if (BLK_SAMPLED(next) && profile_move(om, omp2o(om, next) + META_SIZE,
+                                          omp2o(om, bp) + META_SIZE))
+        sampled = BLK_F_SAMPLED;
+    bin_remove(om, bp);
+    memmove(bp, next, size);
+    BLK_SET(bp, size, BLK_F_USED | prev_free | sampled);
+    dirty_block(om, bp);
+    h = (omhandle *) ((uint8_t *) bp + META_SIZE);
+    table->entry[*h] = omp2o(om, (h + 1));
+
+    next = BLK_NEXT(bp);
+    BLK_SET(next, free, 0);
+    next = coalesce(om, next);
+    bin_insert(om, next);
+    return next;
+}
+
+bool omcompact(om_block * om, size_t budget)
+{
+    om_handles *table;
+    om_meta *bp, *end;
+    bool more = true;
+
+    if (om->flags & OM_BUDDY)
+        return false;
+    omlock(om);
+    table = omo2p(om, om->handles);
+    bp = om->compact ? omo2p(om, om->compact) : (om_meta *) BLK_BASE(om);
+    end = (om_meta *) (BLK_BASE(om) + om->size);
+    while (table) {
+        om_meta *next;
+
+        if (bp >= end) {
+            more = false;
+            break;
+        }
+        if (budget < BLK_MIN_SIZE)
+            break;
+        budget -= BLK_MIN_SIZE;
+        next = BLK_NEXT(bp);
+        if (BLK_FREE(bp) && next < end && movable(om, table, next)) {
+            budget = BLK_SIZE(next) < budget ? budget - BLK_SIZE(next) : 0;
+            bp = slide(om, table, bp, next);
+        } else {
+            bp = next;
+        }
+    }
+    om->compact = more && table ? omp2o(om, bp) : 0;
+    omunlock(om);
+    return more && table;
+}
+
+/* Heap checking and repair.
+ * The check walks the headers once to cut the heap into runs of
+ * CHECK_STRIDE blocks, then threads take runs, bins and the tree */
+#define CHECK_STRIDE            16384
+#define CHECK_THREADS           16
+#define CHECK_TREE_DEPTH        1024
+
+typedef struct om_check_run {
+    offset_t start;
+    size_t prev_free;
+} om_check_run;
+
+typedef struct om_check {
+    om_block *om;
+    unsigned int flags;
+    om_check_run *runs;
+    size_t nruns;
+    offset_t end;               /* Where the walk stopped */
+    size_t limit;               /* Most free blocks the heap can hold */
+    size_t next;                /* Next run, bin or tree to check */
+    size_t problems;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t used_blocks;
+    size_t listed;              /* Free blocks found in the bins and tree */
+} om_check;
+
+static void check_fail(om_check * c, const void *at, const char *what)
+{
+    __atomic_fetch_add(&c->problems, 1, __ATOMIC_RELAXED);
+    if (c->flags & OM_CHECK_VERBOSE)
+        fprintf(stderr, "omcheck: 0x%zx: %s\n", (size_t) at - (size_t) c->om, what);
+}
+
+/* Walk the headers, noting where each run starts. Stops at a header
+ * whose size does not lead to another header within the heap. */
+static bool check_walk(om_check * c)
+{
+    om_block *om = c->om;
+    om_meta *bp = (om_meta *) BLK_BASE(om);
+    om_meta *end = (om_meta *) (BLK_BASE(om) + om->size);
+    size_t prev_free = 0, n;
+
+    for (n = 0; bp < end; n++) {
+        size_t size = BLK_SIZE(bp);
+
+        if (n % CHECK_STRIDE == 0) {
+            if ((c->nruns & (c->nruns - 1)) == 0)
+                c->runs = realloc(c->runs, (c->nruns ? c->nruns * 2 : 1) *
+                                  sizeof(om_check_run));
+            c->runs[c->nruns].start = omp2o(om, bp);
+            c->runs[c->nruns++].prev_free = prev_free;
+        }
+        if (size < BLK_MIN_SIZE || size > (size_t) end - (size_t) bp) {
+            check_fail(c, bp, "bad block size");
+            c->end = omp2o(om, bp);
+            return false;
+        }
+        prev_free = BLK_FREE(bp) ? BLK_F_PREV_FREE : 0;
+        bp = BLK_NEXT(bp);
+    }
+    c->end = omp2o(om, end);
+    if (!(om->flags & OM_BUDDY) && (om->endmark & BLK_F_PREV_FREE) != prev_free)
+        check_fail(c, &om->endmark, "end mark does not match the last block");
+    return true;
+}
+
+/* Footers and prev-free bits of the blocks in a run */
+static void check_run(om_check * c, size_t r)
+{
+    om_block *om = c->om;
+    om_meta *bp = omo2p(om, c->runs[r].start);
+    om_meta *end = omo2p(om, (r + 1 < c->nruns ? c->runs[r + 1].start : c->end));
+    size_t prev_free = c->runs[r].prev_free;
+    size_t free_blocks = 0, free_bytes = 0, used_blocks = 0;
+    bool buddy = om->flags & OM_BUDDY;
+
+    for (; bp < end; bp = BLK_NEXT(bp)) {
+        size_t size = BLK_SIZE(bp);
+
+        if (buddy && ((size & (size - 1)) || (((size_t) bp - BLK_BASE(om)) & (size - 1))))
+            check_fail(c, bp, "buddy block not aligned to its size");
+        if (!buddy && BLK_PREV_FREE(bp) != prev_free)
+            check_fail(c, bp, "prev-free bit does not match the previous block");
+        if (BLK_FREE(bp)) {
+            om_meta *foot = BLK_FOOT(bp);
+            if (BLK_USED(foot) || BLK_SIZE(foot) != size)
+                check_fail(c, foot, "footer does not match the header");
+            if (!buddy && prev_free)
+                check_fail(c, bp, "free block follows a free block");
+            free_blocks++;
+            free_bytes += size;
+        } else {
+            used_blocks++;
+        }
+        prev_free = BLK_FREE(bp) ? BLK_F_PREV_FREE : 0;
+    }
+    __atomic_fetch_add(&c->free_blocks, free_blocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->free_bytes, free_bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->used_blocks, used_blocks, __ATOMIC_RELAXED);
+}
+
+/* A free list or tree entry must be a free block inside the heap */
+static bool check_entry(om_check * c, offset_t o)
+{
+    om_block *om = c->om;
+    size_t base = BLK_BASE(om) - (size_t) om;
+    om_meta *bp = omo2p(om, o);
+
+    return o >= base && o < base + om->size && !(o & (ALIGNMENT - 1)) && BLK_FREE(bp) &&
+        BLK_SIZE(bp) >= BLK_MIN_SIZE && BLK_SIZE(bp) <= base + om->size - o;
+}
+
+/* Links and sizes of one list of bin i */
+static void check_list(om_check * c, int i, offset_t * head)
+{
+    om_block *om = c->om;
+    offset_t prev = 0, o = *head;
+    size_t n = 0;
+
+    while (o) {
+        om_free *fb = omo2p(om, o);
+        size_t size;
+
+        if (!check_entry(c, o)) {
+            check_fail(c, fb, "bin links to something other than a free block");
+            break;
+        }
+        size = BLK_SIZE(&fb->meta);
+        if (size == BLK_MIN_SIZE ? ((om_tiny *) fb)->prev != tiny_link(om, prev) :
+            fb->prev != prev)
+            check_fail(c, fb, "bin back-link does not match");
+        if ((om->flags & OM_BUDDY) ? size != 1UL << i :
+            size >= OM_TREE_MIN_SIZE || bin_index(size) != i ||
+            (size == BLK_MIN_SIZE && tiny_head(om, o) != head))
+            check_fail(c, fb, "free block is in the wrong bin");
+        if (++n > c->limit) {
+            check_fail(c, head, "bin links form a loop");
+            break;
+        }
+        prev = o;
+        o = omp2o(om, free_next(om, fb));
+    }
+    __atomic_fetch_add(&c->listed, n, __ATOMIC_RELAXED);
+}
+
+/* The lists and the map bit of bin i */
+static void check_bin(om_check * c, int i)
+{
+    om_block *om = c->om;
+    offset_t *tiny = omo2p(om, om->tiny);
+    size_t r;
+
+    if (!bin_first(om, i) != !(om->binmap[i / 64] & (1ULL << (i % 64))))
+        check_fail(c, &om->bins[i], "bin map bit does not match the bin");
+    check_list(c, i, &om->bins[i]);
+    for (r = 0; i == TINY_BIN && tiny && r < TINY_REGIONS(om) - 1; r++)
+        check_list(c, i, &tiny[r]);
+}
+
+/* Order, priority and sizes of a subtree, whose nodes must sort
+ * between lo and hi */
+static size_t check_tree(om_check * c, offset_t o, om_tree * lo, om_tree * hi, int depth)
+{
+    om_tree *t = omo2p(c->om, o);
+    size_t n = 1;
+
+    if (!t)
+        return 0;
+    if (!check_entry(c, o)) {
+        check_fail(c, t, "tree links to something other than a free block");
+        return 0;
+    }
+    if (depth > CHECK_TREE_DEPTH) {
+        check_fail(c, t, "tree is too deep, links may form a loop");
+        return 0;
+    }
+    if (BLK_SIZE(&t->meta) < OM_TREE_MIN_SIZE)
+        check_fail(c, t, "small free block is in the tree");
+    if ((lo && !TREE_LESS(lo, t)) || (hi && !TREE_LESS(t, hi)))
+        check_fail(c, t, "tree is out of order");
+    if ((t->left && TREE_PRIO(t->left) > TREE_PRIO(o)) ||
+        (t->right && TREE_PRIO(t->right) > TREE_PRIO(o)))
+        check_fail(c, t, "tree priority is out of order");
+    n += check_tree(c, t->left, lo, t, depth + 1);
+    n += check_tree(c, t->right, t, hi, depth + 1);
+    return n;
+}
+
+static void *check_thread(void *arg)
+{
+    om_check *c = arg;
+    size_t job;
+
+    while ((job = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED)) <
+           c->nruns + OM_NUM_BINS + 1) {
+        if (job < c->nruns)
+            check_run(c, job);
+        else if (job < c->nruns + OM_NUM_BINS)
+            check_bin(c, job - c->nruns);
+        else
+            __atomic_fetch_add(&c->listed, check_tree(c, c->om->tree, NULL, NULL, 0),
+                               __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+size_t omcheck(om_block * om, unsigned int flags, unsigned int threads)
+{
+    om_check c = {.om = om,.flags = flags,.limit = om->size / BLK_MIN_SIZE };
+    pthread_t tids[CHECK_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t started, i;
+    bool walked;
+
+    if (!threads)
+        threads = cpus > 0 ? cpus : 1;
+    if (threads > CHECK_THREADS)
+        threads = CHECK_THREADS;
+    omlock(om);
+    walked = check_walk(&c);
+    for (started = 1; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, check_thread, &c) != 0)
+            break;
+    }
+    check_thread(&c);
+    for (i = 1; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(c.runs);
+
+    if (walked) {
+        if (c.listed < c.free_blocks)
+            check_fail(&c, om, "free blocks are missing from the bins");
+        else if (c.listed > c.free_blocks)
+            check_fail(&c, om, "bins hold more blocks than are free");
+        if (om->stats.free != c.free_bytes || om->stats.free_blocks != c.free_blocks ||
+            om->stats.used_blocks != c.used_blocks)
+            check_fail(&c, &om->stats, "statistics do not match the blocks");
+    }
+    /* The headers are all that is needed to link the free blocks again */
+    if ((flags & OM_CHECK_REPAIR) && c.problems && walked)
+        rebuild_bins(om);
+    else if ((flags & OM_CHECK_REPAIR) && c.problems && (flags & OM_CHECK_VERBOSE))
+        fprintf(stderr, "omcheck: the headers cannot be walked, not repaired\n");
+    omunlock(om);
+    return c.problems;
+}
+
+/* Initialise the process-shared robust lock */
+static int init_lock(om_block * om)
+{
+    pthread_mutexattr_t attr;
+    int rc;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    rc = pthread_mutex_init(&om->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return rc;
+}
+
+om_block *omcreate(const char *fname, size_t rsize, size_t headroom)
+{
+    return omcreate_opts(fname, rsize, headroom, NULL);
+}
+
+/* Attach a SysV shared memory segment */
+static om_block *map_sysv(const char *fname, size_t size, unsigned int flags, int *shmid,
+                          bool *created)
+{
+    int shmflg = (flags & OM_HUGETLB) ? SHM_HUGETLB : 0;
+    om_block *om;
+    key_t key;
+
+    key = ftok(fname, 'R');
+    if (key < 0) {
+        perror("ftok");
+        return NULL;
+    }
+
+    *created = true;
+    *shmid = shmget(key, size, 0644 | IPC_CREAT | IPC_EXCL | shmflg);
+    if (*shmid < 0) {
+        /* Another process is initializing this memory */
+        *shmid = shmget(key, size, 0644 | shmflg);
+        *created = false;
+    }
+
+    om = (om_block *) shmat(*shmid, (void *) 0, 0);
+    if (om == (om_block *) (-1)) {
+        perror("shmat");
+        return NULL;
+    }
+    return om;
+}
+
+/* Sleep until the creator of a segment has initialised it. Segments with
+ * another magic or layout version are rejected without waiting. */
+static bool attach_wait(om_block * om)
+{
+    uint32_t state;
+
+    while (true) {
+        uint32_t magic = __atomic_load_n(&om->magic, __ATOMIC_ACQUIRE);
+        if (magic && (magic != OM_MAGIC || om->version != OM_VERSION))
+            return false;
+        state = __atomic_load_n(&om->state, __ATOMIC_ACQUIRE);
+        if (state != OM_STATE_INIT)
+            return state == OM_STATE_READY && om->magic == OM_MAGIC;
+        syscall(SYS_futex, &om->state, FUTEX_WAIT, state, NULL, NULL, 0);
+    }
+}
+
+static void attach_wake(om_block * om, uint32_t state)
+{
+    __atomic_store_n(&om->state, state, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &om->state, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/* A file is created empty, wait for its creator to set its size */
+static bool wait_size(int fd)
+{
+    struct stat st;
+
+    while (fstat(fd, &st) == 0) {
+        if ((size_t) st.st_size >= sizeof(om_block))
+            return true;
+        usleep(10);
+    }
+    return false;
+}
+
+/* Map a memfd, POSIX shared memory object or regular file */
+static om_block *map_fd(const char *fname, size_t length, size_t size, unsigned int flags,
+                        int *fd, bool *created)
+{
+    int mflags = MAP_SHARED;
+    om_block *om;
+
+    if ((flags & OM_POPULATE) && !(flags & OM_GROWABLE))
+        mflags |= MAP_POPULATE;
+    *created = true;
+    if (flags & OM_MEMFD) {
+        *fd = memfd_create(fname ? fname : "omem",
+                           MFD_CLOEXEC | ((flags & OM_HUGETLB) ? MFD_HUGETLB : 0));
+    } else if (flags & OM_SHM) {
+        *fd = shm_open(fname, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (*fd < 0 && errno == EEXIST) {
+            *fd = shm_open(fname, O_RDWR, 0644);
+            *created = false;
+        }
+    } else {
+        *fd = open(fname, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (*fd < 0 && errno == EEXIST) {
+            *fd = open(fname, O_RDWR | O_CLOEXEC);
+            *created = false;
+        }
+    }
+    if (*fd < 0) {
+        perror("open");
+        return NULL;
+    }
+
+    if (*created && ftruncate(*fd, length) < 0) {
+        perror("ftruncate");
+        close(*fd);
+        return NULL;
+    }
+    if (!*created && !wait_size(*fd)) {
+        close(*fd);
+        return NULL;
+    }
+
+    om = (om_block *) mmap(NULL, size, PROT_READ | PROT_WRITE, mflags, *fd, 0);
+    if (om == MAP_FAILED) {
+        perror("mmap");
+        close(*fd);
+        return NULL;
+    }
+    return om;
+}
+
+/* Map process private anonymous memory */
+static om_block *map_private(size_t size, unsigned int flags)
+{
+    int mflags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    om_block *om;
+
+    if (flags & OM_HUGETLB)
+        mflags |= MAP_HUGETLB;
+    if ((flags & OM_POPULATE) && !(flags & OM_GROWABLE))
+        mflags |= MAP_POPULATE;
+    om = (om_block *) mmap(NULL, size, PROT_READ | PROT_WRITE, mflags, -1, 0);
+    if (om == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return om;
+}
+
+/* Remove a segment this process created but could not initialise, so
+ * its name can be used again */
+static void discard(const char *fname, unsigned int flags, int shmid)
+{
+    if (flags & OM_SHM)
+        shm_unlink(fname);
+    else if (flags & OM_FILE)
+        unlink(fname);
+    else if (!(flags & OM_BACKEND))
+        shmctl(shmid, IPC_RMID, NULL);
+}
+
+static void unmap(om_block * om, size_t size)
+{
+    if (om->flags & OM_BACKEND) {
+        fd_unregister(om);
+        munmap(om, size);
+    } else {
+        shmdt(om);
+    }
+}
+
+/* Map a segment, initialising it if this process created it. A fill
+ * function sets up the heap contents before anyone can attach, and
+ * requires that the segment is new. */
+static om_block *create(const char *fname, size_t rsize, size_t headroom,
+                        const om_options * opts, bool (*fill) (om_block * om, void *arg),
+                        void *arg)
+{
+    unsigned int flags = opts ? opts->flags & ~OM_WARM : 0;
+    unsigned int warm_flags = opts ? opts->flags & OM_WARM : 0;
+    size_t maxsize = opts ? opts->maxsize : 0;
+    size_t release = opts ? opts->release : 0;
+    om_block *om = NULL;
+    bool created = true;
+    int shmid = 0;
+    int fd = -1;
+    om_meta *bp;
+
+    if (!(flags & OM_BACKEND) && fname == NULL)
+        flags |= OM_PRIVATE;
+    if (!fname && (flags & (OM_SHM | OM_FILE)))
+        return NULL;
+    if ((flags & OM_SHM) && (flags & OM_HUGETLB))
+        return NULL;
+    if (flags & OM_GROWABLE) {
+        /* Growth needs a backing that can be extended in place */
+        if (!(flags & OM_BACKEND) || maxsize < rsize)
+            return NULL;
+        maxsize = BLK_ALIGN(maxsize);
+    } else {
+        maxsize = rsize;
+    }
+    if (flags & OM_BUDDY)
+        rsize &= ~(BUDDY_MIN_SIZE - 1);
+
+    size_t length = map_size(rsize, headroom, flags);
+    size_t size = map_size(maxsize, headroom, flags);
+
+    if (flags & OM_PRIVATE)
+        om = map_private(size, flags | warm_flags);
+    else if (flags & OM_BACKEND)
+        om = map_fd(fname, length, size, flags | warm_flags, &fd, &created);
+    else
+        om = map_sysv(fname, size, flags, &shmid, &created);
+    if (!om)
+        return NULL;
+    if (fd >= 0)
+        fd_register(om, fd);
+    if (flags & OM_THP)
+        madvise(om, size, MADV_HUGEPAGE);
+
+    if (!created) {
+        /* Wait for the other process to finish if required */
+        if (fill || !attach_wait(om) || om->flags != flags || om->maxsize != maxsize ||
+            (!(flags & OM_GROWABLE) && om->size != rsize)) {
+            /* Incompatible shared memory segments! */
+            unmap(om, size);
+            return NULL;
+        }
+        if (!warm(om, warm_flags)) {
+            unmap(om, size);
+            return NULL;
+        }
+        return om;
+    }
+
+    om->version = OM_VERSION;
+    __atomic_store_n(&om->magic, OM_MAGIC, __ATOMIC_RELEASE);
+    om->shmid = shmid;
+    om->flags = flags;
+    om->size = rsize;
+    om->maxsize = maxsize;
+    om->headroom = headroom;
+    if ((flags & OM_LOCKED) && init_lock(om) != 0) {
+        perror("pthread_mutex_init");
+        goto failed;
+    }
+    memset(om->binmap, 0, sizeof(om->binmap));
+    memset(om->bins, 0, sizeof(om->bins));
+    memset(&om->stats, 0, sizeof(om->stats));
+    om->tiny = 0;
+    om->tree = 0;
+    om->handles = 0;
+    om->compact = 0;
+    om->sampling = 0;
+    om->profile = 0;
+    om->release = (flags & OM_RELEASE) ? (release ? release : OM_RELEASE_INTERVAL) : 0;
+    om->unreleased = 0;
+    om->dirty = 0;
+    om->checkpoint = 0;
+    om->persister = 0;
+    om->epochs = 0;
+    /* Fresh mappings are zero-filled by the kernel, so the heap
+     * pages are left untouched until they are handed out */
+    if (flags & OM_BUDDY) {
+        buddy_add(om, 0, rsize);
+    } else {
+        bp = (om_meta *) BLK_BASE(om);
+        BLK_SET(bp, rsize, BLK_F_ZERO);
+        bin_insert(om, bp);
+        om->endmark = 0;
+        mark_next(om, bp);
+    }
+    if (!(flags & OM_BUDDY) && TINY_REGIONS(om) > 1) {
+        /* Lists for the minimum sized blocks beyond the first region */
+        size_t len = (TINY_REGIONS(om) - 1) * sizeof(offset_t);
+        void *tiny = _omalloc(om, len, NULL);
+        if (!tiny)
+            goto failed;
+        memset(tiny, 0, len);
+        om->tiny = omp2o(om, tiny);
+    }
+    if (flags & OM_CACHED) {
+        void *caches = _omalloc(om, CACHE_SLOTS * sizeof(om_cache), NULL);
+        if (!caches)
+            goto failed;
+        memset(caches, 0, CACHE_SLOTS * sizeof(om_cache));
+        om->caches = omp2o(om, caches);
+    }
+    if (fill && !fill(om, arg))
+        goto failed;
+    attach_wake(om, OM_STATE_READY);
+    if (!warm(om, warm_flags)) {
+        unmap(om, size);
+        return NULL;
+    }
+    return om;
+
+  failed:
+    /* Tell any attachers and remove the segment so the name can be reused */
+    attach_wake(om, OM_STATE_FAILED);
+    discard(fname, flags, shmid);
+    unmap(om, size);
+    return NULL;
+}
+
+om_block *omcreate_opts(const char *fname, size_t rsize, size_t headroom,
+                        const om_options * opts)
+{
+    return create(fname, rsize, headroom, opts, NULL, NULL);
+}
+
+om_block *omattach(const char *fname, unsigned int flags)
+{
+    size_t pgsz = sysconf(_SC_PAGE_SIZE);
+    int mflags = MAP_SHARED;
+    om_block *om;
+    size_t size;
+    int shmid, fd;
+    key_t key;
+
+    if (!fname)
+        return NULL;
+    if (!(flags & (OM_SHM | OM_FILE))) {
+        key = ftok(fname, 'R');
+        if (key < 0) {
+            perror("ftok");
+            return NULL;
+        }
+        shmid = shmget(key, 0, 0644);
+        if (shmid < 0)
+            return NULL;
+        om = (om_block *) shmat(shmid, (void *) 0, 0);
+        if (om == (om_block *) (-1)) {
+            perror("shmat");
+            return NULL;
+        }
+        if (!attach_wait(om) || !warm(om, flags)) {
+            shmdt(om);
+            return NULL;
+        }
+        return om;
+    }
+
+    if (flags & OM_SHM)
+        fd = shm_open(fname, O_RDWR, 0644);
+    else
+        fd = open(fname, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    /* Map the header alone until the segment is ready to say how big it is */
+    om = wait_size(fd) ? mmap(NULL, pgsz, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (om == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (!attach_wait(om) ||
+        (om->flags & (OM_SHM | OM_FILE)) != (flags & (OM_SHM | OM_FILE))) {
+        munmap(om, pgsz);
+        close(fd);
+        return NULL;
+    }
+    size = map_size(om->maxsize, om->headroom, om->flags);
+    if ((flags & OM_POPULATE) && !(om->flags & OM_GROWABLE))
+        mflags |= MAP_POPULATE;
+    munmap(om, pgsz);
+    om = (om_block *) mmap(NULL, size, PROT_READ | PROT_WRITE, mflags, fd, 0);
+    if (om == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+    fd_register(om, fd);
+    if (!warm(om, flags)) {
+        unmap(om, size);
+        return NULL;
+    }
+    return om;
+}
+
+void omdestroy(om_block * om)
+{
+    if (!om)
+        return;
+    ompersist_stop(om);
+    if (tcache_om == om) {
+        tcache_om = NULL;
+        tcache = NULL;
+    }
+    if (tepoch_om == om) {
+        tepoch_om = NULL;
+        tepoch = NULL;
+    }
+    unmap(om, map_size(om->maxsize, om->headroom, om->flags));
+    return;
+}
+
+/* The persistence thread of a heap in this process */
+typedef struct om_persist {
+    om_block *om;
+    int fd;
+    size_t bandwidth;
+    unsigned int interval;
+    size_t cursor;              /* Next bitmap word to write back */
+    uint64_t started;           /* Checkpoint in progress or last made */
+    uint64_t requested;         /* Checkpoint waited for by ompersist_sync() */
+    bool stop;
+    bool failed;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} om_persist;
+
+static GHashTable *om_persists;
+static pthread_mutex_t om_persists_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static om_persist *persist_lookup(om_block * om)
+{
+    om_persist *p = NULL;
+
+    pthread_mutex_lock(&om_persists_lock);
+    if (om_persists)
+        p = g_hash_table_lookup(om_persists, om);
+    pthread_mutex_unlock(&om_persists_lock);
+    return p;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Start writeback of the marked pages from the cursor on, stopping
+ * once budget bytes have been queued */
+static void persist_trickle(om_persist * p, size_t budget)
+{
+    om_block *om = p->om;
+    uint64_t *map = omo2p(om, om->dirty);
+    size_t pages = map_size(om->size, om->headroom, om->flags) >> DIRTY_SHIFT;
+    size_t words = (pages + 63) / 64;
+    size_t n;
+
+    for (n = 0; n < words && budget; n++) {
+        size_t w = p->cursor;
+        uint64_t bits;
+
+        p->cursor = (p->cursor + 1) % words;
+        if (!__atomic_load_n(&map[w], __ATOMIC_RELAXED))
+            continue;
+        bits = __atomic_exchange_n(&map[w], 0, __ATOMIC_RELAXED);
+        while (bits) {
+            int first = __builtin_ctzll(bits);
+            int last = first;
+            size_t len;
+
+            while (last < 64 && (bits & (1ULL << last)))
+                last++;
+            len = (size_t) (last - first) << DIRTY_SHIFT;
+            sync_file_range(p->fd, (off_t) (w * 64 + first) << DIRTY_SHIFT, len,
+                            SYNC_FILE_RANGE_WRITE);
+            budget = len < budget ? budget - len : 0;
+            bits = last < 64 ? bits & ~((1ULL << last) - 1) : 0;
+        }
+    }
+}
+
+/* Everything written before the checkpoint began is on disk once
+ * fdatasync() returns, and only then is its number stored */
+static bool persist_checkpoint(om_persist * p)
+{
+    uint64_t seq;
+
+    pthread_mutex_lock(&p->lock);
+    seq = ++p->started;
+    pthread_mutex_unlock(&p->lock);
+    if (fdatasync(p->fd) != 0) {
+        perror("fdatasync");
+        return false;
+    }
+    __atomic_store_n(&p->om->checkpoint, seq, __ATOMIC_RELEASE);
+    sync_file_range(p->fd, 0, sizeof(om_block), SYNC_FILE_RANGE_WAIT_BEFORE |
+                    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    return true;
+}
+
+static void *persist_run(void *arg)
+{
+    om_persist *p = arg;
+    uint64_t next = now_ms() + p->interval;
+    struct timespec ts;
+    bool ok = true, wanted;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && ok) {
+        if (p->requested <= p->started && now_ms() < next) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += PERSIST_TICK * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+        }
+        wanted = p->requested > p->started;
+        pthread_mutex_unlock(&p->lock);
+        persist_trickle(p, p->bandwidth / (1000 / PERSIST_TICK));
+        if (wanted || now_ms() >= next) {
+            ok = persist_checkpoint(p);
+            next = now_ms() + p->interval;
+        }
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (ok)
+        ok = persist_checkpoint(p);
+    pthread_mutex_lock(&p->lock);
+    p->failed = !ok;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Claim the heap for this process, taking over from one that has exited */
+static bool persist_claim(om_block * om)
+{
+    uint32_t owner = __atomic_load_n(&om->persister, __ATOMIC_RELAXED);
+
+    while (true) {
+        if (owner &&
+            (owner == (uint32_t) getpid() || kill(owner, 0) == 0 || errno != ESRCH))
+            return false;
+        if (__atomic_compare_exchange_n(&om->persister, &owner, getpid(), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return true;
+    }
+}
+
+bool ompersist_start(om_block * om, size_t bandwidth, unsigned int interval)
+{
+    pthread_condattr_t attr;
+    om_persist *p;
+    int fd = fd_lookup(om);
+
+    if (!(om->flags & OM_FILE) || fd < 0)
+        return false;
+    /* Pages are marked only while a process holds the claim, and the
+     * map stays allocated for the next one */
+    if (!om->dirty) {
+        size_t pages = map_size(om->maxsize, om->headroom, om->flags) >> DIRTY_SHIFT;
+        size_t len = (pages + 63) / 64 * sizeof(uint64_t);
+        bool zero = false;
+        void *map;
+
+        omlock(om);
+        if (!om->dirty) {
+            map = _omalloc(om, len, &zero);
+            if (map && !zero)
+                memset(map, 0, len);
+            om->dirty = omp2o(om, map);
+        }
+        omunlock(om);
+        if (!om->dirty)
+            return false;
+    }
+    if (!persist_claim(om))
+        return false;
+
+    p = calloc(1, sizeof(om_persist));
+    p->om = om;
+    p->fd = fd;
+    p->bandwidth = bandwidth ? bandwidth : OM_PERSIST_BANDWIDTH;
+    p->interval = interval ? interval : OM_PERSIST_INTERVAL;
+    p->started = om->checkpoint;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&p->thread, NULL, persist_run, p) != 0) {
+        perror("pthread_create");
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+        __atomic_store_n(&om->persister, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+    pthread_mutex_lock(&om_persists_lock);
+    if (!om_persists)
+        om_persists = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(om_persists, om, p);
+    pthread_mutex_unlock(&om_persists_lock);
+    return true;
+}
+
+uint64_t ompersist_sync(om_block * om)
+{
+    om_persist *p = persist_lookup(om);
+    uint64_t want;
+
+    if (!p)
+        return 0;
+    pthread_mutex_lock(&p->lock);
+    /* A checkpoint already in progress may have begun before this call */
+    want = p->started + 1;
+    if (p->requested < want)
+        p->requested = want;
+    pthread_cond_broadcast(&p->cond);
+    while (__atomic_load_n(&om->checkpoint, __ATOMIC_ACQUIRE) < want && !p->failed)
+        pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    return p->failed ? 0 : want;
+}
+
+void ompersist_stop(om_block * om)
+{
+    om_persist *p = persist_lookup(om);
+
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_mutex_lock(&om_persists_lock);
+    g_hash_table_remove(om_persists, om);
+    pthread_mutex_unlock(&om_persists_lock);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    __atomic_store_n(&om->persister, 0, __ATOMIC_RELEASE);
+}
+
+/* Only the part of the range inside the segment is marked */
+void ommark_dirty(om_block * om, const void *p, size_t len)
+{
+    size_t start = (size_t) p, end = BLK_BASE(om) + om->size;
+
+    if (!om->persister || !len || start < (size_t) om || start >= end)
+        return;
+    dirty_range(om, p, len < end - start ? len : end - start);
+}
+
+/* A snapshot file holds the segment header and headroom, then one record
+ * for each run of used blocks, followed by their contents, or for each
+ * free block. A zero length record ends it. */
+#define SNAP_MAGIC              0x50414e534d454d4fULL  /* "OMEMSNAP" */
+#define SNAP_CHUNK              (4 * 1024 * 1024)      /* Work unit of restore threads */
+#define SNAP_THREADS            16
+
+typedef struct om_snap_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hdrsize;
+    om_block block;
+} om_snap_header;
+
+typedef struct om_snap_record {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t used;
+} om_snap_record;
+
+/* A run of used blocks to copy, or a free block when from is NULL */
+typedef struct om_snap_chunk {
+    size_t offset;
+    const uint8_t *from;
+    size_t len;
+} om_snap_chunk;
+
+typedef struct om_snap_restore {
+    om_block *om;
+    const uint8_t *map;
+    size_t len;
+    om_snap_chunk *chunks;
+    size_t count;
+    size_t next;
+} om_snap_restore;
+
+bool omsnapshot(om_block * om, const char *path)
+{
+    om_snap_header hdr = {.magic = SNAP_MAGIC,.version = OM_VERSION,
+        .hdrsize = sizeof(om_block)
+    };
+    om_snap_record rec;
+    om_meta *bp, *end;
+    char *tmp;
+    FILE *f;
+    bool ok;
+
+    /* Write beside the target and rename, so a crash leaves the old one */
+    tmp = g_strdup_printf("%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        perror("fopen");
+        g_free(tmp);
+        return false;
+    }
+
+    omlock(om);
+    memcpy(&hdr.block, om, sizeof(om_block));
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+        fwrite((uint8_t *) om + sizeof(om_block), 1, om->headroom, f) == om->headroom;
+    bp = (om_meta *) BLK_BASE(om);
+    end = (om_meta *) (BLK_BASE(om) + om->size);
+    while (ok && bp < end) {
+        om_meta *next = BLK_NEXT(bp);
+
+        rec.offset = (size_t) bp - BLK_BASE(om);
+        rec.used = BLK_USED(bp);
+        while (rec.used && next < end && BLK_USED(next))
+            next = BLK_NEXT(next);
+        rec.length = (size_t) next - (size_t) bp;
+        ok = fwrite(&rec, sizeof(rec), 1, f) == 1 &&
+            (!rec.used || fwrite(bp, 1, rec.length, f) == rec.length);
+        bp = next;
+    }
+    omunlock(om);
+
+    memset(&rec, 0, sizeof(rec));
+    ok = ok && fwrite(&rec, sizeof(rec), 1, f) == 1;
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (ok && rename(tmp, path) != 0) {
+        perror("rename");
+        ok = false;
+    }
+    if (!ok)
+        unlink(tmp);
+    g_free(tmp);
+    return ok;
+}
+
+static void *restore_copy(void *arg)
+{
+    om_snap_restore *r = arg;
+    om_block *om = r->om;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->count) {
+        om_snap_chunk *c = &r->chunks[i];
+        if (c->from) {
+            memcpy((uint8_t *) BLK_BASE(om) + c->offset, c->from, c->len);
+        } else {
+            om_meta *bp = (om_meta *) (BLK_BASE(om) + c->offset);
+            BLK_SET(bp, c->len, false);
+        }
+    }
+    return NULL;
+}
+
+static bool restore_chunk(om_snap_restore * r, size_t offset, const uint8_t * from,
+                          size_t len)
+{
+    om_snap_chunk *c;
+
+    if ((r->count & (r->count - 1)) == 0) {
+        c = realloc(r->chunks, (r->count ? r->count * 2 : 1) * sizeof(om_snap_chunk));
+        if (!c)
+            return false;
+        r->chunks = c;
+    }
+    c = &r->chunks[r->count++];
+    c->offset = offset;
+    c->from = from;
+    c->len = len;
+    return true;
+}
+
+/* A block must be at least the minimum size and fit what is left of its
+ * record. Buddies are also a power of 2 and aligned to their size. */
+static bool restore_size(size_t offset, size_t size, size_t left, unsigned int flags)
+{
+    if (size < BLK_MIN_SIZE || (size & (ALIGNMENT - 1)) || size > left)
+        return false;
+    return !(flags & OM_BUDDY) || (!(size & (size - 1)) && !(offset & (size - 1)));
+}
+
+/* Check every record against the heap size before anything is created,
+ * walking the headers of used runs so the bins can be rebuilt from
+ * them, and cut used runs into chunks for the restore threads */
+static bool restore_plan(om_snap_restore * r, size_t size, size_t headroom,
+                         unsigned int flags)
+{
+    const uint8_t *p = r->map + sizeof(om_snap_header) + headroom;
+    const uint8_t *end = r->map + r->len;
+    size_t offset = 0, i;
+
+    while (true) {
+        const om_snap_record *rec = (const om_snap_record *) p;
+
+        if ((size_t) (end - p) < sizeof(*rec))
+            return false;
+        p += sizeof(*rec);
+        if (!rec->length)
+            break;
+        if (rec->offset != offset || (rec->length & (ALIGNMENT - 1)) ||
+            rec->length > size - offset ||
+            (rec->used && rec->length > (size_t) (end - p)))
+            return false;
+        if (rec->used) {
+            for (i = 0; i < rec->length; i += BLK_SIZE((const om_meta *) (p + i))) {
+                const om_meta *bp = (const om_meta *) (p + i);
+                if (!BLK_USED(bp) ||
+                    !restore_size(offset + i, BLK_SIZE(bp), rec->length - i, flags))
+                    return false;
+            }
+            for (i = 0; i < rec->length; i += SNAP_CHUNK) {
+                if (!restore_chunk(r, offset + i, p + i, rec->length - i < SNAP_CHUNK ?
+                                   rec->length - i : SNAP_CHUNK))
+                    return false;
+            }
+            p += rec->length;
+        } else if (!restore_size(offset, rec->length, rec->length, flags) ||
+                   !restore_chunk(r, offset, NULL, rec->length)) {
+            return false;
+        }
+        offset += rec->length;
+    }
+    return offset == size;
+}
+
+/* An offset taken from a snapshot must be the payload of a used block
+ * with room for a head and count entries */
+static bool restore_block(om_block * om, offset_t o, size_t head, size_t count, size_t each)
+{
+    size_t base = BLK_BASE(om) - (size_t) om;
+    om_meta *bp;
+
+    if (o < base + META_SIZE || o >= base + om->size || (o & (ALIGNMENT - 1)))
+        return false;
+    bp = omo2p(om, o - META_SIZE);
+    return BLK_USED(bp) && BLK_SIZE(bp) >= BLK_MIN_SIZE &&
+        BLK_SIZE(bp) <= base + om->size - (o - META_SIZE) &&
+        BLK_PAYLOAD(BLK_SIZE(bp)) >= head &&
+        count <= (BLK_PAYLOAD(BLK_SIZE(bp)) - head) / each;
+}
+
+/* The offsets and counts of a snapshot's allocator tables must be in
+ * range before anything follows them. Cached blocks, which go back to
+ * the heap, must be used and listed once. */
+static bool restore_check(om_block * om)
+{
+    om_cache *caches = omo2p(om, om->caches);
+    om_epochs *e = omo2p(om, om->epochs);
+    om_handles *table = omo2p(om, om->handles);
+    omprofile *prof = omo2p(om, om->profile);
+    size_t i, j, k, n;
+    offset_t h;
+
+    if ((om->flags & OM_BUDDY) || TINY_REGIONS(om) < 2 ? om->tiny != 0 :
+        !restore_block(om, om->tiny, 0, TINY_REGIONS(om) - 1, sizeof(offset_t)))
+        return false;
+    if (om->dirty && !restore_block(om, om->dirty, 0, 0, 1))
+        return false;
+    if (table) {
+        if (!restore_block(om, om->handles, sizeof(om_handles), 0, 1) ||
+            !restore_block(om, om->handles, sizeof(om_handles), table->count,
+                           sizeof(offset_t)))
+            return false;
+        for (h = table->free, n = 0; h; h = table->entry[h] >> 1) {
+            if (h >= table->count || !(table->entry[h] & 1) || ++n > table->count)
+                return false;
+        }
+    }
+    if (prof && (!restore_block(om, om->profile, sizeof(omprofile), 0, 1) ||
+                 !restore_block(om, om->profile, sizeof(omprofile), prof->count,
+                                sizeof(omsample))))
+        return false;
+    for (i = 0; prof && i < prof->count; i++) {
+        offset_t o = prof->sample[i].offset;
+        if (o && o != PROF_DELETED && !restore_block(om, o, 0, 0, 1))
+            return false;
+    }
+    if (caches && !restore_block(om, om->caches, 0, CACHE_SLOTS, sizeof(om_cache)))
+        return false;
+    for (i = 0; caches && i < CACHE_SLOTS * CACHE_CLASSES; i++) {
+        om_cache *c = &caches[i / CACHE_CLASSES];
+        offset_t seen[CACHE_DEPTH], o = c->head[i % CACHE_CLASSES];
+
+        if (c->count[i % CACHE_CLASSES] > CACHE_DEPTH)
+            return false;
+        for (j = 0; j < c->count[i % CACHE_CLASSES]; j++) {
+            if (!restore_block(om, o, sizeof(offset_t), 0, 1))
+                return false;
+            for (k = 0; k < j; k++) {
+                if (seen[k] == o)
+                    return false;
+            }
+            seen[j] = o;
+            o = *(offset_t *) omo2p(om, o);
+        }
+    }
+    if (e) {
+        om_deferred *q = omo2p(om, e->queue);
+
+        if (!restore_block(om, om->epochs, sizeof(om_epochs), 0, 1) || e->count > e->size ||
+            (e->size && !restore_block(om, e->queue, 0, e->size, sizeof(om_deferred))))
+            return false;
+        for (i = 0; i < e->count; i++) {
+            if (!restore_block(om, q[i].block, 0, 0, 1))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* Thread caches, reader slots, the profiler and the dirty page map belong
+ * to the processes that made the snapshot. Cached and retired blocks go
+ * back to the heap and the rest is dropped. */
+static void restore_reset(om_block * om)
+{
+    om_cache *caches = omo2p(om, om->caches);
+    om_epochs *e = omo2p(om, om->epochs);
+    size_t i;
+
+    for (i = 0; caches && i < CACHE_SLOTS; i++) {
+        cache_drain_all(om, &caches[i]);
+        caches[i].owner = 0;
+    }
+    if (e) {
+        om_deferred *q = omo2p(om, e->queue);
+        for (i = 0; i < e->count; i++)
+            _omfree(om, omo2p(om, q[i].block));
+        e->count = 0;
+        memset(e->slot, 0, sizeof(e->slot));
+    }
+    if (om->profile)
+        omprofile_stop(om);
+    if (om->dirty) {
+        _omfree(om, omo2p(om, om->dirty));
+        om->dirty = 0;
+    }
+}
+
+/* Lay the planned snapshot out in a new heap. Free blocks only get their
+ * header, used runs are copied by several threads and the bins are
+ * rebuilt. */
+static bool restore_fill(om_block * om, void *arg)
+{
+    om_snap_restore *r = arg;
+    const om_snap_header *hdr = (const om_snap_header *) r->map;
+    pthread_t threads[SNAP_THREADS];
+    size_t n, i, started;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memcpy((uint8_t *) om + sizeof(om_block), hdr + 1, om->headroom);
+    r->om = om;
+    n = r->count;
+    if (n > (size_t) cpus)
+        n = cpus;
+    if (n > SNAP_THREADS)
+        n = SNAP_THREADS;
+    for (started = 1; started < n; started++) {
+        if (pthread_create(&threads[started], NULL, restore_copy, r) != 0)
+            break;
+    }
+    restore_copy(r);
+    for (i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    om->caches = hdr->block.caches;
+    om->tiny = hdr->block.tiny;
+    om->handles = hdr->block.handles;
+    om->profile = hdr->block.profile;
+    om->dirty = hdr->block.dirty;
+    om->epochs = hdr->block.epochs;
+    if (!restore_check(om))
+        return false;
+    rebuild_bins(om);
+    restore_reset(om);
+    return true;
+}
+
+om_block *omrestore(const char *path, const char *fname)
+{
+    om_snap_restore r = { };
+    const om_snap_header *hdr;
+    om_block *om = NULL;
+    om_options opts = { };
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(om_snap_header)) {
+        close(fd);
+        return NULL;
+    }
+    r.len = st.st_size;
+    r.map = mmap(NULL, r.len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r.map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    madvise((void *) r.map, r.len, MADV_WILLNEED);
+
+    hdr = (const om_snap_header *) r.map;
+    if (hdr->magic == SNAP_MAGIC && hdr->version == OM_VERSION &&
+        hdr->hdrsize == sizeof(om_block) &&
+        r.len - sizeof(om_snap_header) >= hdr->block.headroom &&
+        restore_plan(&r, hdr->block.size, hdr->block.headroom, hdr->block.flags)) {
+        opts.flags = hdr->block.flags;
+        opts.maxsize = hdr->block.maxsize;
+        opts.release = hdr->block.release;
+        /* Without a name, named backings are restored as private memory */
+        if (!fname && (opts.flags & (OM_SHM | OM_FILE)))
+            opts.flags &= ~(OM_SHM | OM_FILE);
+        om = create(fname, hdr->block.size, hdr->block.headroom, &opts, restore_fill, &r);
+    }
+    free(r.chunks);
+    munmap((void *) r.map, r.len);
+    return om;
 }
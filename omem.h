@@ -18,6 +18,8 @@
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
 
+#include <pthread.h>
+
 /* Make it clear what parameters are offsets
  */
 typedef size_t offset_t;
@@ -32,25 +34,290 @@ typedef size_t offset_t;
  * Offset based memory allocator
  *********************************/
 /**
- * A memory segment provided to the allocator
+ * Free blocks are kept in size segregated bins.
+ * Bins below 512 bytes hold a single block size (8 byte spacing),
+ * the rest hold power of 2 ranges. Blocks of OM_TREE_MIN_SIZE and
+ * above are kept in a size ordered tree and allocated best-fit.
+ */
+#define OM_NUM_BINS     128
+#define OM_TREE_MIN_SIZE (128 * 1024)
+
+/**
+ * Allocator statistics, kept as running totals so they are cheap to read.
+ * omstats_get() takes no lock, so the fields may be from moments apart
+ * while other threads allocate. Thread cached blocks count as used. Class
+ * i counts used blocks of more than 2^(i-1) and up to 2^i bytes. Once the
+ * largest free block is taken, the next omstats_get() finds the new one
+ * under the lock, walking the highest bin when it holds a size range.
+ */
+#define OMSTATS_CLASSES 64
+
+struct omstats {
+    size_t size;
+    size_t used;
+    size_t free;
+    size_t used_blocks;
+    size_t free_blocks;
+    size_t largest_free;
+    size_t classes[OMSTATS_CLASSES];
+};
+
+/**
+ * A memory segment provided to the allocator. The magic and version stay
+ * first in every layout so any version can tell whether it can attach.
+ * Attachers sleep on the state word until the creator has finished.
  */
+#define OM_MAGIC        0x4d454d4f      /* "OMEM" */
+#define OM_VERSION      4
+#define OM_STATE_INIT   0
+#define OM_STATE_READY  1
+#define OM_STATE_FAILED 2
+
 typedef struct om_block {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state;
     int shmid;
+    unsigned int flags;
     size_t size;
-    offset_t next;
+    size_t maxsize;
     size_t headroom;
+    pthread_mutex_t lock;
+    offset_t caches;
+    uint64_t binmap[OM_NUM_BINS / 64];
+    offset_t bins[OM_NUM_BINS];
+    offset_t tiny;
+    offset_t tree;
+    size_t endmark;
+    offset_t handles;
+    offset_t compact;
+    size_t sampling;
+    offset_t profile;
+    size_t release;
+    size_t unreleased;
+    offset_t dirty;
+    uint64_t checkpoint;
+    uint32_t persister;
+    offset_t epochs;
+    struct omstats stats;
 } om_block;
 
+/**
+ * Options for creating a memory segment
+ */
+#define OM_LOCKED       (1 << 0)        /* Serialise access with a process-shared lock */
+#define OM_CACHED       (1 << 1)        /* Per-thread caches of small freed blocks */
+#define OM_PRIVATE      (1 << 2)        /* Process private (the default without a name) */
+#define OM_MEMFD        (1 << 3)        /* memfd_create(), shared with forked children */
+#define OM_SHM          (1 << 4)        /* POSIX shm_open() object named by fname */
+#define OM_FILE         (1 << 5)        /* Regular file at fname mapped MAP_SHARED */
+#define OM_HUGETLB      (1 << 6)        /* Explicit huge pages (reserved hugetlb pages) */
+#define OM_THP          (1 << 7)        /* Ask for transparent huge pages */
+#define OM_GROWABLE     (1 << 8)        /* Grow up to maxsize instead of running out */
+#define OM_BUDDY        (1 << 9)        /* Buddy system, bounded time alloc and free */
+#define OM_RELEASE      (1 << 10)       /* Give large free blocks back to the OS */
+#define OM_POPULATE     (1 << 11)       /* Map with MAP_POPULATE on attach */
+#define OM_PREFAULT     (1 << 12)       /* Touch every page on attach, using threads */
+#define OM_MLOCK        (1 << 13)       /* Lock the heap into memory on attach */
+#define OM_BACKEND      (OM_PRIVATE | OM_MEMFD | OM_SHM | OM_FILE)
+#define OM_WARM         (OM_POPULATE | OM_PREFAULT | OM_MLOCK)
+#define OM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define OM_RELEASE_INTERVAL (4 * 1024 * 1024)
+
+/* With no backend flag and a name, a SysV segment keyed by ftok(fname) is used.
+ * OM_HUGETLB applies to OM_MEMFD, OM_PRIVATE, SysV and an OM_FILE path on
+ * hugetlbfs. OM_SHM objects cannot live on hugetlbfs, so it is rejected there.
+ * OM_GROWABLE needs one of the mmap backends (not SysV). The full maxsize is
+ * reserved at the same address in every process, so offsets stay valid.
+ * OM_BUDDY rounds every block up to a power of 2, trading space for
+ * O(log size) allocation and free. omalloc_aligned() is not supported.
+ * OM_RELEASE drops the pages inside free blocks of OM_TREE_MIN_SIZE and up
+ * each time release bytes (default OM_RELEASE_INTERVAL) have been freed.
+ * Released blocks read as zero and are not touched again until reused.
+ * The OM_WARM flags apply only to the calling process and are not part of
+ * the segment, so readers can attach with them to a heap made without.
+ * They cover the header, headroom and current heap. OM_POPULATE falls back
+ * to OM_PREFAULT for SysV and growable heaps. Attach fails if mlock() does. */
+
+/* omattach() maps an existing SysV (flags 0), OM_SHM or OM_FILE segment
+ * without knowing how it was created, waiting for it to be initialised.
+ * The OM_WARM flags may be added. */
+
+typedef struct om_options {
+    unsigned int flags;
+    size_t maxsize;             /* Limit for OM_GROWABLE */
+    size_t release;             /* Bytes freed between OM_RELEASE passes */
+} om_options;
+
 /**
  * Routines for memory allocation
  */
 om_block *omcreate(const char *fname, size_t size, size_t headroom);
+om_block *omcreate_opts(const char *fname, size_t size, size_t headroom,
+                        const om_options * opts);
+om_block *omattach(const char *fname, unsigned int flags);
 void *omalloc(om_block * om, size_t size);
+void *omcalloc(om_block * om, size_t nmemb, size_t size);
+void *omalloc_aligned(om_block * om, size_t size, size_t align);
+size_t omalloc_bulk(om_block * om, size_t size, size_t n, void **out);
+void omfree_bulk(om_block * om, void **ptrs, size_t n);
 void omfree(om_block * om, void *m);
+void *omrealloc(om_block * om, void *m, size_t size);
 size_t omavailable(om_block * om);
 void omstats(om_block * om);
+void omstats_get(om_block * om, struct omstats *stats);
 void omdestroy(om_block * om);
 
+/**
+ * Hold the segment lock across several calls (OM_LOCKED only).
+ * The lock is recursive, so allocations may be made while holding it.
+ * Hash table and hash tree updates take the lock themselves, list heads
+ * are owned by the caller so list updates must be wrapped explicitly.
+ */
+void omlock(om_block * om);
+void omunlock(om_block * om);
+
+/**
+ * Return the calling thread's cached blocks to the heap (OM_CACHED only).
+ * Cached blocks count as used until flushed. Caches left behind by
+ * threads that have exited are reclaimed on demand.
+ */
+void omcache_flush(om_block * om);
+
+/**
+ * Epoch based reclamation, so readers in any process can walk lists, hash
+ * tables and hash trees without the lock while writers remove entries.
+ * Readers bracket each walk with omepoch_enter() and omepoch_exit(), which
+ * only store to the calling thread's slot, and may nest. Writers unlink an
+ * entry and pass it to omfree_deferred(), which frees it once every reader
+ * that was inside when it was queued has left. Queued blocks are freed by
+ * every OMEPOCH_BATCH'th omfree_deferred() or by omepoch_reclaim(), which
+ * returns how many were freed. Once a heap has used epochs, omhtree_delete()
+ * defers its frees. Up to OMEPOCH_READERS threads can be readers, slots of
+ * threads that have exited are reused; omepoch_enter() fails without one.
+ * The reader table and queue are allocated under the heap lock on first
+ * use, so both calls fail (and leave the block alone) without OM_LOCKED.
+ */
+#define OMEPOCH_READERS 128
+#define OMEPOCH_BATCH   64
+
+bool omepoch_enter(om_block * om);
+void omepoch_exit(om_block * om);
+bool omfree_deferred(om_block * om, void *m);
+size_t omepoch_reclaim(om_block * om);
+
+/**
+ * Relocatable blocks, reached through a stable handle instead of a
+ * pointer so that omcompact() can move them. A pointer from omhptr()
+ * is only valid until the next omcompact(); hold omlock() across its
+ * use if another thread may be compacting.
+ */
+typedef size_t omhandle;
+
+omhandle omhalloc(om_block * om, size_t size);
+void *omhptr(om_block * om, omhandle h);
+void omhfree(om_block * om, omhandle h);
+
+/**
+ * Slide handle blocks down into the free space before them, resuming
+ * where the last call stopped. Each call does about budget bytes of
+ * work (bytes moved plus 32 per block passed) and returns true until
+ * it reaches the end of the heap. Not available with OM_BUDDY.
+ */
+bool omcompact(om_block * om, size_t budget);
+
+/**
+ * Check the heap after a writer died part way through an update. omcheck()
+ * walks the block headers, then checks the footers and prev-free bits,
+ * the next/prev links of the bins and the order of the large block tree,
+ * sharing the work between up to threads threads (0 for one per CPU).
+ * It returns the number of problems found, printed on stderr with
+ * OM_CHECK_VERBOSE. OM_CHECK_REPAIR then links every block marked free
+ * back into the bins from the headers, merging free neighbours, so free
+ * blocks lost from the bins are recovered. A heap whose headers cannot be
+ * walked is not repaired. The segment lock is held throughout.
+ */
+#define OM_CHECK_REPAIR  (1 << 0)
+#define OM_CHECK_VERBOSE (1 << 1)
+
+size_t omcheck(om_block * om, unsigned int flags, unsigned int threads);
+
+/**
+ * Warm restart. omsnapshot() writes the headroom and used blocks of a heap
+ * to a file, holding the segment lock while it walks the heap. omrestore()
+ * creates a new segment named fname with the same options and fills it
+ * before any other process can attach, so offsets stay valid. Without a
+ * name, OM_SHM and OM_FILE heaps are restored as private memory.
+ * omrestore() fails if the segment already exists.
+ */
+bool omsnapshot(om_block * om, const char *path);
+om_block *omrestore(const char *path, const char *fname);
+
+/**
+ * Background persistence for OM_FILE heaps. ompersist_start() runs a thread
+ * in the calling process that starts writeback of dirty pages at up to
+ * bandwidth bytes a second, and every interval ms makes a checkpoint: once
+ * everything written before it began is on disk, its number is stored in
+ * om->checkpoint. Block tags are marked dirty as blocks are allocated and freed,
+ * and ommark_dirty() marks user writes so they are written back early; writes
+ * that are not marked still reach the disk by the next checkpoint. Writers
+ * never wait for the disk. ompersist_sync() asks for a checkpoint and waits
+ * for it, returning its number (0 if this process is not persisting).
+ * One process persists a heap at a time, until it stops or exits. Pages
+ * are only marked while it persists; ommark_dirty() ignores the part of a
+ * range outside the segment.
+ */
+#define OM_PERSIST_BANDWIDTH (64 * 1024 * 1024)
+#define OM_PERSIST_INTERVAL  1000
+
+bool ompersist_start(om_block * om, size_t bandwidth, unsigned int interval);
+uint64_t ompersist_sync(om_block * om);
+void ompersist_stop(om_block * om);
+void ommark_dirty(om_block * om, const void *p, size_t len);
+
+/**
+ * Sampling allocation profiler. While started, about one in every interval
+ * bytes allocated by omalloc(), omcalloc(), omrealloc() and the bulk and
+ * aligned variants is sampled: the call stack is kept in a table in the heap
+ * until the block is freed, so any process can see live bytes by call site.
+ * The table holds up to samples entries. When stopped, the only cost is a
+ * test of om->sampling on allocation and free.
+ */
+#define OMPROFILE_DEPTH   16
+#define OMPROFILE_SAMPLES 1024
+
+typedef struct omsample {
+    offset_t offset;            /* Payload of the sampled block, 0 if unused */
+    size_t size;
+    uint32_t pid;
+    uint32_t depth;
+    uintptr_t stack[OMPROFILE_DEPTH];
+} omsample;
+
+typedef struct omprofile {
+    size_t interval;
+    size_t count;
+    size_t live;
+    size_t used;                /* Live and deleted entries */
+    size_t dropped;             /* Samples not kept because the table was full */
+    omsample sample[0];
+} omprofile;
+
+/* Live samples with the same call stack, estimate corrects for the sampling rate */
+typedef struct omprofile_site {
+    size_t bytes;
+    size_t estimate;
+    size_t samples;
+    uint32_t pid;
+    uint32_t depth;
+    uintptr_t stack[OMPROFILE_DEPTH];
+} omprofile_site;
+
+bool omprofile_start(om_block * om, size_t interval, size_t samples);
+void omprofile_stop(om_block * om);
+size_t omprofile_sites(om_block * om, omprofile_site * sites, size_t n);
+void omprofile_report(om_block * om, size_t n);
+
 /*********************************
  * Offset based list
  *********************************/
@@ -76,6 +343,8 @@ typedef bool(*omlist_find_fn) (om_block * om, omlistentry * e, void *data);
 omlistentry *omlist_find(om_block * om, omlist l, omlist_find_fn func, void *data);
 typedef int (*omlist_cmp_fn) (om_block * om, omlistentry * e1, omlistentry * e2);
 omlist omlist_sort(om_block * om, omlist l, omlist_cmp_fn func);
+/* Count entries outside the segment, broken back-links and loops */
+size_t omlist_check(om_block * om, omlist l);
 
 /*********************************
  * Offset based hash table
@@ -103,6 +372,12 @@ typedef bool(*omhtable_cmp_fn) (om_block * om, omhtentry * e, void *data);
 omhtentry *omhtable_find(om_block * om, omhtable * ht, omhtable_cmp_fn cmp, size_t hash,
                          void *data);
 void omhtable_stats(om_block * om, omhtable * ht);
+/* Check every bucket's chain with omlist_check(), across up to threads
+ * threads (0 for one per CPU). Given the hash of an entry, also count
+ * entries in the wrong bucket. Returns the number of problems. */
+typedef size_t (*omhtable_hash_fn) (om_block * om, omhtentry * e);
+size_t omhtable_check(om_block * om, omhtable * ht, omhtable_hash_fn hash,
+                      unsigned int threads);
 size_t omhtable_strhash(const char *s);
 
 /*********************************
@@ -125,3 +400,46 @@ omhtree *omhtree_get(om_block * om, omhtree * root, const char *path);
 #define omhtree_key(om, node) ((const char *) omo2p(om, ((omhtree *) node)->key))
 omhtree *omhtree_child(om_block * om, omhtree * node, omhtree * prev);
 void omhtree_stats(om_block * om, omhtree * tree);
+
+/*********************************
+ * Offset based slab allocator
+ *********************************/
+/**
+ * Fixed size objects carved from pages of the heap.
+ * Slots carry no header, alloc and free are lock-free.
+ */
+#define OMSLAB_PAGE_SIZE (64 * 1024)
+
+typedef struct omslab {
+    size_t size;
+    size_t count;
+    uint64_t free;
+    offset_t pages;
+} omslab;
+
+omslab *omslab_create(om_block * om, size_t size);
+void *omslab_alloc(om_block * om, omslab * slab);
+void omslab_free(om_block * om, omslab * slab, void *m);
+void omslab_destroy(om_block * om, omslab * slab);
+
+/*********************************
+ * Offset based region allocator
+ *********************************/
+/**
+ * Bump allocation from chunks of the heap, released all at once.
+ * Objects carry no header and cannot be freed individually.
+ * An arena must only be used by one thread at a time.
+ */
+#define OMARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct omarena {
+    size_t chunk;
+    offset_t chunks;
+    offset_t next;
+    offset_t end;
+} omarena;
+
+omarena *omarena_create(om_block * om, size_t chunk);
+void *omarena_alloc(om_block * om, omarena * arena, size_t size);
+void omarena_reset(om_block * om, omarena * arena);
+void omarena_destroy(om_block * om, omarena * arena);
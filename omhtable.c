@@ -23,6 +23,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include <glib.h>
 #include "omem.h"
 
@@ -66,17 +67,27 @@ void omhtable_stats(om_block * om, omhtable * ht)
 
 void omhtable_add(om_block * om, omhtable * ht, size_t hash, omhtentry * e)
 {
-    assert(ht && ht->size && e && !e->next);
+    omlist l;
+
+    assert(ht && ht->size && e);
     hash = hash % ht->size;
-    ht->table[hash] = omlist_prepend(om, ht->table[hash], (omlistentry *) e);
+    omlock(om);
+    l = omlist_prepend(om, ht->table[hash], (omlistentry *) e);
+    __atomic_store_n(&ht->table[hash], l, __ATOMIC_RELEASE);
+    omunlock(om);
     return;
 }
 
 void omhtable_delete(om_block * om, omhtable * ht, size_t hash, omhtentry * e)
 {
+    omlist l;
+
     assert(ht && ht->size && e);
     hash = hash % ht->size;
-    ht->table[hash] = omlist_remove(om, ht->table[hash], (omlistentry *) e);
+    omlock(om);
+    l = omlist_remove(om, ht->table[hash], (omlistentry *) e);
+    __atomic_store_n(&ht->table[hash], l, __ATOMIC_RELEASE);
+    omunlock(om);
     return;
 }
 
@@ -92,16 +103,22 @@ size_t omhtable_size(om_block * om, omhtable * ht)
 
 omhtentry *omhtable_get(om_block * om, omhtable * ht, size_t hash, int *offset)
 {
+    omlist l;
+
     hash = hash % ht->size;
-    return (omhtentry *) omlist_get(om, ht->table[hash], (*offset)++);
+    l = __atomic_load_n(&ht->table[hash], __ATOMIC_ACQUIRE);
+    return (omhtentry *) omlist_get(om, l, (*offset)++);
 }
 
 omhtentry *omhtable_find(om_block * om, omhtable * ht, omhtable_cmp_fn cmp, size_t hash,
                          void *data)
 {
+    omlist l;
+
     assert(ht && ht->size);
     hash = hash % ht->size;
-    return (omhtentry *) omlist_find(om, ht->table[hash], (omlist_find_fn) cmp, data);
+    l = __atomic_load_n(&ht->table[hash], __ATOMIC_ACQUIRE);
+    return (omhtentry *) omlist_find(om, l, (omlist_find_fn) cmp, data);
 }
 
 size_t omhtable_strhash(const char *s)
@@ -114,3 +131,61 @@ size_t omhtable_strhash(const char *s)
     }
     return hash;
 }
+
+#define HTABLE_CHECK_THREADS 16
+
+typedef struct htable_check {
+    om_block *om;
+    omhtable *ht;
+    omhtable_hash_fn hash;
+    size_t next;
+    size_t problems;
+} htable_check;
+
+static void *htable_check_thread(void *arg)
+{
+    htable_check *c = arg;
+    size_t i, problems = 0;
+
+    while ((i = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED)) < (size_t) c->ht->size) {
+        omlistentry *e;
+        size_t p = omlist_check(c->om, c->ht->table[i]);
+
+        problems += p;
+        /* Only a sound chain can be walked to look at the hashes */
+        for (e = p ? NULL : omo2p(c->om, c->ht->table[i]); e && c->hash;
+             e = omo2p(c->om, e->next)) {
+            if (c->hash(c->om, e) % c->ht->size != i)
+                problems++;
+        }
+    }
+    __atomic_fetch_add(&c->problems, problems, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+size_t omhtable_check(om_block * om, omhtable * ht, omhtable_hash_fn hash,
+                      unsigned int threads)
+{
+    htable_check c = {.om = om,.ht = ht,.hash = hash };
+    pthread_t tids[HTABLE_CHECK_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t started, i;
+
+    assert(ht && ht->size);
+    if (!threads)
+        threads = cpus > 0 ? cpus : 1;
+    if (threads > HTABLE_CHECK_THREADS)
+        threads = HTABLE_CHECK_THREADS;
+    if (threads > (size_t) ht->size)
+        threads = ht->size;
+    omlock(om);
+    for (started = 1; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, htable_check_thread, &c) != 0)
+            break;
+    }
+    htable_check_thread(&c);
+    for (i = 1; i < started; i++)
+        pthread_join(tids[i], NULL);
+    omunlock(om);
+    return c.problems;
+}
@@ -32,6 +32,16 @@ static bool _htable_find_cmp_fn(om_block * om, omlistentry * e, void *data)
     return (key && strcmp(key, (char *) data) == 0);
 }
 
+/* Readers may be walking the tree without the lock once any has entered
+ * an epoch, so what they could reach is not freed until they leave */
+static void omhtree_free(om_block * om, void *m)
+{
+    if (om->epochs)
+        omfree_deferred(om, m);
+    else
+        omfree(om, m);
+}
+
 static bool omhtree_empty(om_block * om, omhtree * tree)
 {
     return tree->children == 0 || (omhtable_size(om, omo2p(om, tree->children)) == 0);
@@ -76,13 +86,14 @@ omhtree *omhtree_get(om_block * om, omhtree * root, const char *path)
     char *key = NULL;
     omhtree *next = root;
     omhtree *ret = root;
+    omhtable *table;
 
     char *p = g_strdup(path);
     key = strtok_r(p, "/", &ptr);
     while (key) {
         ret = next;
-        if (next->children) {
-            omhtable *table = (omhtable *) omo2p(om, next->children);
+        table = omo2p(om, __atomic_load_n(&next->children, __ATOMIC_ACQUIRE));
+        if (table) {
             next = (omhtree *) omhtable_find(om, table, _htable_find_cmp_fn,
                                              omhtable_strhash(key), key);
             ret = next;
@@ -110,6 +121,7 @@ omhtree *omhtree_add(om_block * om, omhtree * root, const char *path, size_t siz
     if (size < sizeof(omhtree))
         return NULL;
 
+    omlock(om);
     key = strtok_r(p, "/", &ptr);
     while (key) {
         omhtable *children = parent->children ? omo2p(om, parent->children) : NULL;
@@ -118,23 +130,22 @@ omhtree *omhtree_add(om_block * om, omhtree * root, const char *path, size_t siz
                                               omhtable_strhash(key), key)) != NULL) {
             parent = node;
         } else {
-            node = omalloc(om, size);
-            memset(node, 0, size);
+            node = omcalloc(om, 1, size);
             node->parent = omp2o(om, parent);
             char *nkey = omalloc(om, strlen(key) + 1);
             node->key = omp2o(om, nkey);
             memcpy(nkey, key, strlen(key) + 1);
             if (parent->children == 0) {
-                children = omalloc(om, OMHTABLE_SIZE(32));
-                memset(children, 0, OMHTABLE_SIZE(32));
+                children = omcalloc(om, 1, OMHTABLE_SIZE(32));
                 children->size = 32;
-                parent->children = omp2o(om, children);
+                __atomic_store_n(&parent->children, omp2o(om, children), __ATOMIC_RELEASE);
             }
             omhtable_add(om, children, omhtable_strhash(key), (omlistentry *) node);
             parent = node;
         }
         key = strtok_r(NULL, "/", &ptr);
     }
+    omunlock(om);
     g_free(p);
     return parent;
 }
@@ -144,13 +155,14 @@ void omhtree_delete(om_block * om, omhtree * root, omhtree * node)
     if (!node || !node->key)
         return;
 
+    omlock(om);
     omhtree *parent = (omhtree *) omo2p(om, node->parent);
     if (parent && parent->children) {
         omhtable *table = (omhtable *) omo2p(om, parent->children);
         char *key = (char *) omo2p(om, node->key);
         omhtable_delete(om, table, omhtable_strhash(key), (omlistentry *) node);
         if (omhtable_size(om, table) == 0) {
-            omfree(om, table);
+            omhtree_free(om, table);
             parent->children = 0;
         }
     }
@@ -168,11 +180,11 @@ void omhtree_delete(om_block * om, omhtree * root, omhtree * node)
                 omhtree_delete(om, node, child);
             }
         }
-        omfree(om, table);
+        omhtree_free(om, table);
     }
 
-    omfree(om, omo2p(om, node->key));
-    omfree(om, node);
+    omhtree_free(om, omo2p(om, node->key));
+    omhtree_free(om, node);
 
     if (parent) {
         /* This is now a hanging node, remove it */
@@ -180,6 +192,7 @@ void omhtree_delete(om_block * om, omhtree * root, omhtree * node)
             omhtree_delete(om, root, parent);
         }
     }
+    omunlock(om);
 }
 
 omhtree *omhtree_child(om_block * om, omhtree * node, omhtree * prev)
@@ -26,6 +26,10 @@
 #include <glib.h>
 #include "omem.h"
 
+/* Lock-free readers only follow next links. An entry's links are set
+ * before a release store makes it reachable, and a removed entry keeps
+ * its next link so a reader stopped on it can carry on. Every insert
+ * therefore sets next, as a reused entry still points into its old list. */
 omlist omlist_prepend(om_block * om, omlist l, omlistentry * e)
 {
     omlistentry *list = omo2p(om, l);
@@ -33,7 +37,7 @@ omlist omlist_prepend(om_block * om, omlist l, omlistentry * e)
     if (list) {
         if (list->prev) {
             omlistentry *prev = omo2p(om, list->prev);
-            prev->next = omp2o(om, e);
+            __atomic_store_n(&prev->next, omp2o(om, e), __ATOMIC_RELEASE);
         }
         e->prev = list->prev;
         list->prev = omp2o(om, e);
@@ -46,12 +50,13 @@ omlist omlist_prepend(om_block * om, omlist l, omlistentry * e)
 omlist omlist_append(om_block * om, omlist l, omlistentry * e)
 {
     omlistentry *list = omo2p(om, l);
+    e->next = 0;
     if (list) {
         omlistentry *last = list;
         while (last && last->next)
             last = omo2p(om, last->next);
-        last->next = omp2o(om, e);
         e->prev = omp2o(om, last);
+        __atomic_store_n(&last->next, omp2o(om, e), __ATOMIC_RELEASE);
         return omp2o(om, list);
     } else {
         e->prev = 0;
@@ -67,7 +72,7 @@ omlist omlist_remove(om_block * om, omlist l, omlistentry * e)
     if (e->prev) {
         omlistentry *prev = omo2p(om, e->prev);
         assert(prev->next == omp2o(om, e));
-        prev->next = e->next;
+        __atomic_store_n(&prev->next, e->next, __ATOMIC_RELEASE);
     }
     if (e->next) {
         omlistentry *next = omo2p(om, e->next);
@@ -76,7 +81,6 @@ omlist omlist_remove(om_block * om, omlist l, omlistentry * e)
     }
     if (e == list)
         list = omo2p(om, list->next);
-    e->next = 0;
     e->prev = 0;
     return omp2o(om, list);
 }
@@ -87,7 +91,7 @@ size_t omlist_length(om_block * om, omlist l)
     size_t length = 0;
     while (list) {
         length++;
-        list = omo2p(om, list->next);
+        list = omo2p(om, __atomic_load_n(&list->next, __ATOMIC_ACQUIRE));
     }
     return length;
 }
@@ -96,7 +100,7 @@ omlistentry *omlist_get(om_block * om, omlist l, unsigned int offset)
 {
     omlistentry *list = omo2p(om, l);
     while ((offset-- > 0) && list)
-        list = omo2p(om, list->next);
+        list = omo2p(om, __atomic_load_n(&list->next, __ATOMIC_ACQUIRE));
     return list;
 }
 
@@ -135,7 +139,7 @@ omlistentry *omlist_find(om_block * om, omlist l, omlist_find_fn func, void *dat
     while (list) {
         if (func(om, list, data))
             return list;
-        list = omo2p(om, list->next);
+        list = omo2p(om, __atomic_load_n(&list->next, __ATOMIC_ACQUIRE));
     }
     return NULL;
 }
@@ -189,3 +193,28 @@ omlist omlist_sort(om_block * om, omlist l, omlist_cmp_fn func)
                              omlist_sort(om, omp2o(om, list), func),
                              omlist_sort(om, omp2o(om, l2), func), func);
 }
+
+/* A loop is found when a second walk at half speed is caught up */
+size_t omlist_check(om_block * om, omlist l)
+{
+    size_t lo = sizeof(om_block);
+    size_t hi = sizeof(om_block) + om->headroom + om->size;
+    offset_t prev = 0, slow = l, o = l;
+    size_t problems = 0, n = 0;
+
+    while (o) {
+        omlistentry *e = omo2p(om, o);
+
+        if (o < lo || o > hi - sizeof(omlistentry) || (o & (sizeof(offset_t) - 1)))
+            return problems + 1;
+        if (e->prev != prev)
+            problems++;
+        prev = o;
+        o = e->next;
+        if (n++ & 1)
+            slow = ((omlistentry *) omo2p(om, slow))->next;
+        if (o && o == slow)
+            return problems + 1;
+    }
+    return problems;
+}
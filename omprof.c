@@ -0,0 +1,165 @@
+/**
+ * @file omprof.c
+ * Live bytes by call site from the sampling allocation profiler
+ *
+ * Copyright 2017, ECLB Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include "omem.h"
+
+/* Order samples by process and call stack so equal sites are adjacent */
+static int sample_cmp(const void *a, const void *b)
+{
+    const omsample *sa = a;
+    const omsample *sb = b;
+
+    if (sa->pid != sb->pid)
+        return sa->pid < sb->pid ? -1 : 1;
+    if (sa->depth != sb->depth)
+        return sa->depth < sb->depth ? -1 : 1;
+    return memcmp(sa->stack, sb->stack, sa->depth * sizeof(uintptr_t));
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+    const omprofile_site *sa = a;
+    const omprofile_site *sb = b;
+
+    return (sa->estimate < sb->estimate) - (sa->estimate > sb->estimate);
+}
+
+size_t omprofile_sites(om_block * om, omprofile_site * sites, size_t n)
+{
+    omsample *samples;
+    omprofile_site *all, *site = NULL;
+    omprofile *prof;
+    size_t count = 0, nsites = 0, interval, i;
+
+    /* Copy the live samples out so the lock is not held while sorting */
+    omlock(om);
+    prof = omo2p(om, om->profile);
+    if (!prof) {
+        omunlock(om);
+        return 0;
+    }
+    interval = prof->interval;
+    samples = malloc(prof->live * sizeof(omsample) + 1);
+    for (i = 0; i < prof->count && count < prof->live; i++) {
+        omsample *s = &prof->sample[i];
+        /* Skip unused and deleted entries, which have odd offsets */
+        if (!s->offset || (s->offset & 1))
+            continue;
+        samples[count++] = *s;
+    }
+    omunlock(om);
+
+    qsort(samples, count, sizeof(omsample), sample_cmp);
+    all = malloc(count * sizeof(omprofile_site) + 1);
+    for (i = 0; i < count; i++) {
+        omsample *s = &samples[i];
+
+        if (!site || sample_cmp(s, &samples[i - 1]) != 0) {
+            site = &all[nsites++];
+            memset(site, 0, sizeof(omprofile_site));
+            site->pid = s->pid;
+            site->depth = s->depth;
+            memcpy(site->stack, s->stack, s->depth * sizeof(uintptr_t));
+        }
+        /* A block of size bytes is sampled with probability 1 - e^(-size/interval) */
+        site->bytes += s->size;
+        site->estimate += s->size / (1 - exp(-(double) s->size / interval));
+        site->samples++;
+    }
+    qsort(all, nsites, sizeof(omprofile_site), site_cmp);
+    if (n > nsites)
+        n = nsites;
+    memcpy(sites, all, n * sizeof(omprofile_site));
+    free(all);
+    free(samples);
+    return n;
+}
+
+/* Name an address as module+offset using the maps of the sampled process */
+static void print_frame(FILE * maps, uintptr_t addr)
+{
+    char line[512], path[256];
+    unsigned long start, end, offset;
+
+    if (maps) {
+        rewind(maps);
+        while (fgets(line, sizeof(line), maps)) {
+            path[0] = '\0';
+            if (sscanf(line, "%lx-%lx %*s %lx %*s %*s %255s", &start, &end, &offset,
+                       path) < 3)
+                continue;
+            if (addr >= start && addr < end && path[0]) {
+                printf("    %s+0x%lx\n", path, addr - start + offset);
+                return;
+            }
+        }
+    }
+    printf("    0x%lx\n", (unsigned long) addr);
+}
+
+void omprofile_report(om_block * om, size_t n)
+{
+    omprofile_site *sites;
+    omprofile *prof;
+    size_t count, i, j;
+
+    if (!n)
+        n = 10;
+    prof = omo2p(om, om->profile);
+    if (!prof) {
+        printf("Profiler not running\n");
+        return;
+    }
+    printf("Profile: 1 sample per %zu bytes, %zu live, %zu dropped\n",
+           prof->interval, prof->live, prof->dropped);
+
+    sites = malloc(n * sizeof(omprofile_site));
+    count = omprofile_sites(om, sites, n);
+    for (i = 0; i < count; i++) {
+        omprofile_site *site = &sites[i];
+        FILE *maps = NULL;
+        char path[64];
+
+        printf("%zu bytes estimated (%zu bytes in %zu samples) pid %u\n",
+               site->estimate, site->bytes, site->samples, site->pid);
+        if (site->pid == (uint32_t) getpid()) {
+            char **names = backtrace_symbols((void **) site->stack, site->depth);
+            for (j = 0; names && j < site->depth; j++)
+                printf("    %s\n", names[j]);
+            free(names);
+            if (names)
+                continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%u/maps", site->pid);
+        maps = fopen(path, "r");
+        for (j = 0; j < site->depth; j++)
+            print_frame(maps, site->stack[j]);
+        if (maps)
+            fclose(maps);
+    }
+    free(sites);
+}
@@ -0,0 +1,129 @@
+/**
+ * @file omslab.c
+ * Offset based fixed size slab allocator
+ *
+ * Copyright 2017, ECLB Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+#include "omem.h"
+
+/* The free list head carries a generation tag above the offset so that
+ * a concurrent pop and push of the same slot cannot be mistaken (ABA) */
+#define SLAB_OFFSET_BITS        48
+#define SLAB_OFFSET_MASK        ((1ULL << SLAB_OFFSET_BITS) - 1)
+#define SLAB_OFFSET(head)       ((offset_t) ((head) & SLAB_OFFSET_MASK))
+#define SLAB_HEAD(offset,head)  ((uint64_t) (offset) | \
+                                 ((((head) >> SLAB_OFFSET_BITS) + 1) << SLAB_OFFSET_BITS))
+
+/* Each page starts with a link to the next page of the slab */
+typedef struct omslab_page {
+    offset_t next;
+    uint8_t slots[0];
+} omslab_page;
+
+/* Push a chain of slots linked through their first word */
+static void slab_push(om_block * om, omslab * slab, void *first, void *last)
+{
+    uint64_t head = __atomic_load_n(&slab->free, __ATOMIC_RELAXED);
+    offset_t offset = omp2o(om, first);
+    do {
+        *(offset_t *) last = SLAB_OFFSET(head);
+    } while (!__atomic_compare_exchange_n(&slab->free, &head, SLAB_HEAD(offset, head), true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Carve a new page into slots */
+static bool slab_grow(om_block * om, omslab * slab)
+{
+    omslab_page *page = omalloc(om, OMSLAB_PAGE_SIZE);
+    uint8_t *slot;
+    size_t i;
+
+    if (!page)
+        return false;
+    for (i = 0, slot = page->slots; i < slab->count - 1; i++, slot += slab->size)
+        *(offset_t *) slot = omp2o(om, slot + slab->size);
+    slab_push(om, slab, page->slots, slot);
+
+    page->next = __atomic_load_n(&slab->pages, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slab->pages, &page->next, omp2o(om, page), true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+}
+
+omslab *omslab_create(om_block * om, size_t size)
+{
+    omslab *slab;
+
+    size = (size + sizeof(offset_t) - 1) & ~(sizeof(offset_t) - 1);
+    if (!size || size > (OMSLAB_PAGE_SIZE - sizeof(omslab_page)))
+        return NULL;
+    assert(((size_t) om->size >> SLAB_OFFSET_BITS) == 0);
+    slab = omalloc(om, sizeof(omslab));
+    if (!slab)
+        return NULL;
+    slab->size = size;
+    slab->count = (OMSLAB_PAGE_SIZE - sizeof(omslab_page)) / size;
+    slab->free = 0;
+    slab->pages = 0;
+    return slab;
+}
+
+void *omslab_alloc(om_block * om, omslab * slab)
+{
+    uint64_t head = __atomic_load_n(&slab->free, __ATOMIC_ACQUIRE);
+    offset_t *slot;
+
+    do {
+        while (!SLAB_OFFSET(head)) {
+            if (!slab_grow(om, slab))
+                return NULL;
+            head = __atomic_load_n(&slab->free, __ATOMIC_ACQUIRE);
+        }
+        /* Pages are never returned while the slab exists, so the link
+         * is readable even if another thread has just taken this slot */
+        slot = omo2p(om, SLAB_OFFSET(head));
+    } while (!__atomic_compare_exchange_n(&slab->free, &head,
+                                          SLAB_HEAD(__atomic_load_n(slot, __ATOMIC_RELAXED),
+                                                    head), true, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+    return slot;
+}
+
+void omslab_free(om_block * om, omslab * slab, void *m)
+{
+    if (m)
+        slab_push(om, slab, m, m);
+}
+
+void omslab_destroy(om_block * om, omslab * slab)
+{
+    omslab_page *page;
+
+    if (!slab)
+        return;
+    while ((page = omo2p(om, slab->pages)) != NULL) {
+        slab->pages = page->next;
+        omfree(om, page);
+    }
+    omfree(om, slab);
+}
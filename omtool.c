@@ -0,0 +1,118 @@
+/**
+ * @file omtool.c
+ * Inspect a shared memory segment from outside the processes using it
+ *
+ * Copyright 2017, ECLB Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "omem.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s|-f] <name> <command> [args]\n"
+            "  -s  POSIX shm object (default SysV keyed by the file <name>)\n"
+            "  -f  regular file\n"
+            "Commands:\n"
+            "  stats                    print allocator statistics\n"
+            "  profile [sites]          live bytes by call site of sampled blocks\n"
+            "  profile-start <interval> sample once per interval bytes\n"
+            "  profile-stop             stop sampling and discard the samples\n"
+            "  check [threads]          verify the heap, exit 2 on problems\n"
+            "  repair [threads]         verify the heap and relink its free blocks\n"
+            "profile-start, profile-stop and repair need a heap created with OM_LOCKED\n",
+            prog);
+}
+
+/* Only the heap lock keeps changes made from here out of the way of the
+ * processes using the heap */
+static bool writable(om_block * om, const char *cmd)
+{
+    if (om->flags & OM_LOCKED)
+        return true;
+    fprintf(stderr, "%s needs a heap created with OM_LOCKED\n", cmd);
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int flags = 0;
+    const char *cmd;
+    om_block *om;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sfh")) != -1) {
+        switch (opt) {
+        case 's':
+            flags = OM_SHM;
+            break;
+        case 'f':
+            flags = OM_FILE;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    om = omattach(argv[optind], flags);
+    if (!om) {
+        fprintf(stderr, "Failed to attach to %s\n", argv[optind]);
+        return 1;
+    }
+
+    cmd = argv[optind + 1];
+    if ((strcmp(cmd, "profile-start") == 0 || strcmp(cmd, "profile-stop") == 0 ||
+         strcmp(cmd, "repair") == 0) && !writable(om, cmd)) {
+        ret = 1;
+    } else if (strcmp(cmd, "stats") == 0) {
+        omstats(om);
+    } else if (strcmp(cmd, "profile") == 0) {
+        omprofile_report(om, argc - optind > 2 ? strtoul(argv[optind + 2], NULL, 0) : 0);
+    } else if (strcmp(cmd, "profile-start") == 0 && argc - optind > 2) {
+        if (!omprofile_start(om, strtoul(argv[optind + 2], NULL, 0), 0)) {
+            fprintf(stderr, "Failed to start the profiler\n");
+            ret = 1;
+        }
+    } else if (strcmp(cmd, "profile-stop") == 0) {
+        omprofile_stop(om);
+    } else if (strcmp(cmd, "check") == 0 || strcmp(cmd, "repair") == 0) {
+        unsigned int threads = argc - optind > 2 ? strtoul(argv[optind + 2], NULL, 0) : 0;
+        bool repair = strcmp(cmd, "repair") == 0;
+        size_t problems;
+
+        problems = omcheck(om, OM_CHECK_VERBOSE | (repair ? OM_CHECK_REPAIR : 0), threads);
+        printf("%zu problems found\n", problems);
+        if (repair && problems) {
+            problems = omcheck(om, 0, threads);
+            printf("%zu problems left after repair\n", problems);
+        }
+        ret = problems ? 2 : 0;
+    } else {
+        usage(argv[0]);
+        ret = 1;
+    }
+    omdestroy(om);
+    return ret;
+}
@@ -18,12 +18,21 @@
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <glib.h>
 #include <CUnit/Basic.h>
 #include "omem.h"
@@ -32,6 +41,10 @@
 #define TEST_ENTRIES        10000
 #define TEST_ITERATIONS_BIG 50000
 #define TEST_SHM_FNAME      "/tmp/omem_test.shm"
+#define TEST_LOCK_FNAME     "/tmp/omem_test_lock.shm"
+#define TEST_PROCESSES      4
+#define TEST_HEAP_FNAME     "/tmp/omem_test.heap"
+#define TEST_POSIX_SHM      "/omem_test"
 #define TEST_HEADROOM       8
 
 static inline uint64_t get_time_us(void)
@@ -138,86 +151,1629 @@ void test_malloc_twice_reverse()
     CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
 }
 
+void test_malloc_reuse()
+{
+    void *m1, *m2, *m3;
+    CU_ASSERT((m1 = omalloc(omm, 100)) != 0);
+    CU_ASSERT((m2 = omalloc(omm, 8)) != 0);
+    omfree(omm, m1);
+    CU_ASSERT((m3 = omalloc(omm, 100)) == m1);
+    omfree(omm, m2);
+    omfree(omm, m3);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_mixed_sizes()
+{
+    void *m[256];
+    int i;
+    for (i = 0; i < 256; i++)
+        CU_ASSERT((m[i] = omalloc(omm, 1 + (rand() % 4096))) != 0);
+    for (i = 0; i < 256; i += 2)
+        omfree(omm, m[i]);
+    for (i = 0; i < 256; i += 2)
+        CU_ASSERT((m[i] = omalloc(omm, 1 + (rand() % 4096))) != 0);
+    for (i = 0; i < 256; i++)
+        omfree(omm, m[i]);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_no_footer()
+{
+    uint8_t *m1, *m2, *m3;
+    CU_ASSERT((m1 = omalloc(omm, 24)) != 0);
+    CU_ASSERT((m2 = omalloc(omm, 24)) != 0);
+    CU_ASSERT((m3 = omalloc(omm, 24)) != 0);
+    CU_ASSERT(m2 == m1 + 32);
+    memset(m1, 0xff, 24);
+    memset(m2, 0xff, 24);
+    omfree(omm, m1);
+    omfree(omm, m3);
+    omfree(omm, m2);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+/* Small keys take a header and the payload rounded up to 8 bytes */
+void test_malloc_footprint()
+{
+    uint8_t *m[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        CU_ASSERT((m[i] = omalloc(omm, 5 + i * 3)) != 0);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE - 4 * 24);
+    for (i = 1; i < 4; i++)
+        CU_ASSERT(m[i] == m[i - 1] + 24);
+    omfree(omm, m[1]);
+    omfree(omm, m[3]);
+    CU_ASSERT(omalloc(omm, 16) == m[1]);
+    CU_ASSERT(omcheck(omm, 0, 0) == 0);
+    for (i = 0; i < 4; i++) {
+        if (i != 3)
+            omfree(omm, m[i]);
+    }
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+/* Heaps past 16 GiB keep a list of minimum sized blocks for each region */
+void test_malloc_big_heap()
+{
+    size_t size = 40ULL << 30;
+    uint8_t *a[2], *m[4], *big;
+    om_block *om;
+    int i;
+
+    CU_ASSERT((om = omcreate(NULL, size, 0)) != NULL);
+    for (i = 0; i < 2; i++)
+        CU_ASSERT((a[i] = omalloc(om, 16)) != NULL);
+    CU_ASSERT((big = omalloc(om, 17ULL << 30)) != NULL);
+    for (i = 0; i < 4; i++)
+        CU_ASSERT((m[i] = omalloc(om, 16)) != NULL);
+    CU_ASSERT((size_t) (m[0] - (uint8_t *) om) > (16ULL << 30));
+    omfree(om, m[0]);
+    omfree(om, m[2]);
+    CU_ASSERT(omcheck(om, 0, 1) == 0);
+    CU_ASSERT(omalloc(om, 16) == m[2]);
+    omfree(om, a[0]);
+    omfree(om, m[2]);
+    CU_ASSERT(omcheck(om, 0, 1) == 0);
+    CU_ASSERT(omalloc(om, 16) == a[0]);
+    CU_ASSERT(omalloc(om, 16) == m[2]);
+    CU_ASSERT(omalloc(om, 16) == m[0]);
+    omfree(om, big);
+    for (i = 0; i < 4; i++)
+        omfree(om, m[i]);
+    for (i = 0; i < 2; i++)
+        omfree(om, a[i]);
+    CU_ASSERT(omcheck(om, 0, 1) == 0);
+    CU_ASSERT(omavailable(om) == size - 24);
+    omdestroy(om);
+}
+
+void test_stats()
+{
+    struct omstats stats;
+    void *m1, *m2, *m3;
+
+    omstats_get(omm, &stats);
+    CU_ASSERT(stats.size == TEST_HEAP_SIZE);
+    CU_ASSERT(stats.free == TEST_HEAP_SIZE && stats.used == 0);
+    CU_ASSERT(stats.free_blocks == 1 && stats.used_blocks == 0);
+    CU_ASSERT(stats.largest_free == TEST_HEAP_SIZE);
+
+    CU_ASSERT((m1 = omalloc(omm, 100)) != 0);
+    CU_ASSERT((m2 = omalloc(omm, 1000)) != 0);
+    CU_ASSERT((m3 = omalloc(omm, 100)) != 0);
+    omfree(omm, m2);
+    omstats_get(omm, &stats);
+    CU_ASSERT(stats.used_blocks == 2 && stats.free_blocks == 2);
+    CU_ASSERT(stats.used + stats.free == TEST_HEAP_SIZE);
+    CU_ASSERT(stats.free == omavailable(omm));
+    CU_ASSERT(stats.classes[7] == 2 && stats.classes[10] == 0);
+    CU_ASSERT(stats.largest_free < TEST_HEAP_SIZE - stats.used);
+
+    CU_ASSERT(omrealloc(omm, m1, 1000) == m1);
+    omstats_get(omm, &stats);
+    CU_ASSERT(stats.classes[7] == 1 && stats.classes[10] == 1);
+    omfree(omm, m1);
+    omfree(omm, m3);
+    omstats_get(omm, &stats);
+    CU_ASSERT(stats.used_blocks == 0 && stats.free_blocks == 1);
+    CU_ASSERT(stats.classes[7] == 0 && stats.classes[10] == 0);
+    CU_ASSERT(stats.largest_free == TEST_HEAP_SIZE);
+}
+
+static void *__attribute__ ((noinline)) profile_site_a(size_t size)
+{
+    return omalloc(omm, size);
+}
+
+static void *__attribute__ ((noinline)) profile_site_b(size_t size)
+{
+    return omcalloc(omm, 1, size);
+}
+
+void test_profile()
+{
+    omprofile_site sites[4];
+    void *a[3], *b, *c;
+    int i;
+
+    CU_ASSERT(omprofile_sites(omm, sites, 4) == 0);
+    CU_ASSERT(omprofile_start(omm, 1, 64));
+    for (i = 0; i < 3; i++)
+        CU_ASSERT((a[i] = profile_site_a(100)) != NULL);
+    CU_ASSERT((b = profile_site_b(1000)) != NULL);
+    CU_ASSERT(omprofile_sites(omm, sites, 4) == 2);
+    CU_ASSERT(sites[0].bytes == 1000 && sites[0].samples == 1);
+    CU_ASSERT(sites[1].bytes == 300 && sites[1].samples == 3);
+    CU_ASSERT(sites[1].estimate == 300 && sites[1].depth > 0);
+    CU_ASSERT(sites[0].pid == getpid());
+    CU_ASSERT(memcmp(sites[0].stack, sites[1].stack, sizeof(uintptr_t)) != 0);
+
+    /* Freed and moved blocks leave the table */
+    omfree(omm, a[1]);
+    CU_ASSERT((b = omrealloc(omm, b, 5000)) != NULL);
+    CU_ASSERT(omprofile_sites(omm, sites, 4) == 2);
+    CU_ASSERT(sites[0].bytes == 5000 && sites[1].bytes == 200);
+    omfree(omm, b);
+
+    /* A full table drops samples, the sampled blocks can still be freed */
+    CU_ASSERT(omprofile_start(omm, 1, 2));
+    CU_ASSERT(omprofile_sites(omm, sites, 4) == 1 && sites[0].samples == 1);
+    CU_ASSERT((c = omalloc(omm, 64)) != NULL);
+    CU_ASSERT(omprofile_sites(omm, sites, 4) == 1);
+    omfree(omm, c);
+    CU_ASSERT(((omprofile *) omo2p(omm, omm->profile))->dropped == 2);
+    omprofile_report(omm, 4);
+
+    omprofile_stop(omm);
+    CU_ASSERT(omprofile_sites(omm, sites, 4) == 0);
+    omfree(omm, a[0]);
+    omfree(omm, a[2]);
+    CU_ASSERT(!omprofile_start(omm, 0, 0));
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+#define TEST_SNAPSHOT "/tmp/omem_test.snap"
+#define TEST_SNAP_BLOCK 16      /* Where the segment header starts in a snapshot */
+
+/* Overwrite a word of the snapshot, returning what was there */
+static uint64_t snapshot_poke(off_t at, uint64_t value)
+{
+    uint64_t old = 0;
+    int fd = open(TEST_SNAPSHOT, O_RDWR);
+
+    CU_ASSERT(pread(fd, &old, sizeof(old), at) == sizeof(old));
+    CU_ASSERT(pwrite(fd, &value, sizeof(value), at) == sizeof(value));
+    close(fd);
+    return old;
+}
+
+/* The first block header of the first run of used blocks */
+static off_t snapshot_used(void)
+{
+    off_t at = TEST_SNAP_BLOCK + sizeof(om_block) + TEST_HEADROOM;
+    uint64_t rec[3];
+    int fd = open(TEST_SNAPSHOT, O_RDONLY);
+
+    while (pread(fd, rec, sizeof(rec), at) == sizeof(rec) && rec[1] && !rec[2])
+        at += sizeof(rec);
+    close(fd);
+    return at + sizeof(rec);
+}
+
+void test_snapshot()
+{
+    struct omstats before, after;
+    char *m[64], *r;
+    uint64_t saved;
+    om_block *om;
+    off_t at;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        m[i] = omalloc(omm, 16 + i * 40);
+        sprintf(m[i], "block %d", i);
+    }
+    for (i = 0; i < 64; i += 3)
+        omfree(omm, m[i]);
+    strcpy((char *) omm + sizeof(om_block), "root");
+    omstats_get(omm, &before);
+    CU_ASSERT(omsnapshot(omm, TEST_SNAPSHOT));
+
+    CU_ASSERT((om = omrestore(TEST_SNAPSHOT, NULL)) != NULL);
+    CU_ASSERT(om->flags == (omm->flags | OM_PRIVATE) && om->size == omm->size);
+    CU_ASSERT(strcmp((char *) om + sizeof(om_block), "root") == 0);
+    omstats_get(om, &after);
+    CU_ASSERT(after.used == before.used && after.free == before.free);
+    CU_ASSERT(after.used_blocks == before.used_blocks);
+    CU_ASSERT(after.largest_free == before.largest_free);
+    for (i = 1; i < 64; i++) {
+        if (i % 3 == 0)
+            continue;
+        r = omo2p(om, omp2o(omm, m[i]));
+        CU_ASSERT(atoi(r + 6) == i);
+        omfree(om, r);
+    }
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE);
+    omdestroy(om);
+
+    /* Existing segments and damaged files are refused */
+    if (!(omm->flags & OM_PRIVATE))
+        CU_ASSERT(omrestore(TEST_SNAPSHOT, TEST_SHM_FNAME) == NULL);
+    saved = snapshot_poke(snapshot_used(), 0);
+    CU_ASSERT(omrestore(TEST_SNAPSHOT, NULL) == NULL);
+    snapshot_poke(snapshot_used(), saved);
+    at = TEST_SNAP_BLOCK + offsetof(om_block, handles);
+    saved = snapshot_poke(at, omp2o(omm, m[0]));
+    CU_ASSERT(omrestore(TEST_SNAPSHOT, NULL) == NULL);
+    snapshot_poke(at, saved);
+    CU_ASSERT((om = omrestore(TEST_SNAPSHOT, NULL)) != NULL);
+    omdestroy(om);
+    CU_ASSERT(truncate(TEST_SNAPSHOT, 1000) == 0);
+    CU_ASSERT(omrestore(TEST_SNAPSHOT, NULL) == NULL);
+    unlink(TEST_SNAPSHOT);
+    for (i = 1; i < 64; i++) {
+        if (i % 3)
+            omfree(omm, m[i]);
+    }
+    memset((char *) omm + sizeof(om_block), 0, TEST_HEADROOM);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_check()
+{
+    size_t *mark, saved;
+    char *m[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        m[i] = omalloc(omm, 100);
+    omfree(omm, m[2]);
+    omfree(omm, m[5]);
+    CU_ASSERT(omcheck(omm, 0, 0) == 0);
+    CU_ASSERT(omcheck(omm, OM_CHECK_REPAIR, 1) == 0);
+
+    /* A writer died after marking a block free, before binning it */
+    mark = (size_t *) m[6] - 1;
+    *mark &= ~(size_t) 1;
+    CU_ASSERT(omcheck(omm, 0, 0) > 0);
+    CU_ASSERT(omcheck(omm, OM_CHECK_REPAIR, 0) > 0);
+    CU_ASSERT(omcheck(omm, 0, 0) == 0);
+
+    /* A bin whose head links back to something */
+    omfree(omm, m[0]);
+    ((offset_t *) m[0])[1] = omp2o(omm, m[1]);
+    CU_ASSERT(omcheck(omm, 0, 2) > 0);
+    CU_ASSERT(omcheck(omm, OM_CHECK_REPAIR, 2) > 0);
+    CU_ASSERT(omcheck(omm, 0, 2) == 0);
+
+    /* Headers that cannot be walked are left alone */
+    mark = (size_t *) m[4] - 1;
+    saved = *mark;
+    *mark = 0;
+    CU_ASSERT(omcheck(omm, OM_CHECK_REPAIR, 0) > 0);
+    CU_ASSERT(omcheck(omm, 0, 0) > 0);
+    *mark = saved;
+    CU_ASSERT(omcheck(omm, 0, 0) == 0);
+
+    omfree(omm, m[1]);
+    omfree(omm, m[3]);
+    omfree(omm, m[4]);
+    omfree(omm, m[7]);
+    CU_ASSERT(omcheck(omm, 0, 0) == 0);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_realloc_null()
+{
+    void *m;
+    CU_ASSERT((m = omrealloc(omm, NULL, 16)) != 0);
+    CU_ASSERT(omrealloc(omm, m, 0) == NULL);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_realloc_grow_in_place()
+{
+    char *m1, *m2;
+    CU_ASSERT((m1 = omalloc(omm, 16)) != 0);
+    CU_ASSERT((m2 = omalloc(omm, 64)) != 0);
+    strcpy(m1, "hello world");
+    omfree(omm, m2);
+    CU_ASSERT(omrealloc(omm, m1, 64) == m1);
+    CU_ASSERT(strcmp(m1, "hello world") == 0);
+    omfree(omm, m1);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_realloc_shrink_in_place()
+{
+    char *m1, *m2;
+    CU_ASSERT((m1 = omalloc(omm, 1024)) != 0);
+    CU_ASSERT((m2 = omalloc(omm, 16)) != 0);
+    strcpy(m1, "hello world");
+    CU_ASSERT(omrealloc(omm, m1, 16) == m1);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE - 48);
+    CU_ASSERT(strcmp(m1, "hello world") == 0);
+    omfree(omm, m1);
+    omfree(omm, m2);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_realloc_move()
+{
+    char *m1, *m2, *m3;
+    CU_ASSERT((m1 = omalloc(omm, 16)) != 0);
+    CU_ASSERT((m2 = omalloc(omm, 16)) != 0);
+    strcpy(m1, "hello world");
+    CU_ASSERT((m3 = omrealloc(omm, m1, 4096)) != m1);
+    CU_ASSERT(strcmp(m3, "hello world") == 0);
+    omfree(omm, m2);
+    omfree(omm, m3);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+static bool is_zero(const uint8_t * m, size_t size)
+{
+    while (size--) {
+        if (*m++)
+            return false;
+    }
+    return true;
+}
+
+void test_calloc_fresh()
+{
+    void *m;
+    CU_ASSERT((m = omcalloc(omm, 16, 64)) != 0);
+    CU_ASSERT(is_zero(m, 16 * 64));
+    omfree(omm, m);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_calloc_reused()
+{
+    void *m1, *m2;
+    CU_ASSERT((m1 = omalloc(omm, 64)) != 0);
+    CU_ASSERT((m2 = omalloc(omm, 8)) != 0);
+    memset(m1, 0xff, 64);
+    omfree(omm, m1);
+    CU_ASSERT(omcalloc(omm, 1, 64) == m1);
+    CU_ASSERT(is_zero(m1, 64));
+    omfree(omm, m1);
+    omfree(omm, m2);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_calloc_whole_heap()
+{
+    om_block *om = omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, NULL);
+    uint8_t *m;
+
+    /* The block's last word held the footer of the fresh free block */
+    CU_ASSERT((m = omcalloc(om, 1, TEST_HEAP_SIZE - 8)) != 0);
+    CU_ASSERT(is_zero(m + TEST_HEAP_SIZE - 64, 56));
+    omfree(om, m);
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE);
+    omdestroy(om);
+}
+
+void test_calloc_overflow()
+{
+    CU_ASSERT(omcalloc(omm, SIZE_MAX / 2, 4) == NULL);
+    CU_ASSERT(omcalloc(omm, 0, 4) == NULL);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_aligned()
+{
+    size_t aligns[] = { 16, 64, 4096 };
+    void *m[3], *pad;
+    int i;
+
+    CU_ASSERT((pad = omalloc(omm, 8)) != 0);
+    for (i = 0; i < 3; i++) {
+        CU_ASSERT((m[i] = omalloc_aligned(omm, 100, aligns[i])) != 0);
+        CU_ASSERT(((size_t) m[i] & (aligns[i] - 1)) == 0);
+        memset(m[i], 0xff, 100);
+    }
+    omfree(omm, pad);
+    for (i = 0; i < 3; i++)
+        omfree(omm, m[i]);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_aligned_bad()
+{
+    CU_ASSERT(omalloc_aligned(omm, 100, 0) == NULL);
+    CU_ASSERT(omalloc_aligned(omm, 100, 48) == NULL);
+    CU_ASSERT(omalloc_aligned(omm, 0, 64) == NULL);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_bulk()
+{
+    void *m[TEST_ENTRIES];
+    int i;
+
+    CU_ASSERT(omalloc_bulk(omm, 40, TEST_ENTRIES, m) == TEST_ENTRIES);
+    for (i = 0; i < TEST_ENTRIES; i++) {
+        CU_ASSERT(m[i] != NULL);
+        memset(m[i], i, 40);
+    }
+    for (i = 1; i < TEST_ENTRIES; i++)
+        CU_ASSERT(m[i] != m[i - 1]);
+    omfree_bulk(omm, m, TEST_ENTRIES);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_free_bulk_mixed()
+{
+    void *m[TEST_ENTRIES + 1];
+    int i;
+
+    for (i = 0; i < TEST_ENTRIES; i++)
+        m[i] = omalloc(omm, 1 + (rand() % 512));
+    m[TEST_ENTRIES] = NULL;
+    for (i = 0; i <= TEST_ENTRIES; i++) {
+        int j = rand() % (TEST_ENTRIES + 1);
+        void *t = m[i];
+        m[i] = m[j];
+        m[j] = t;
+    }
+    omfree_bulk(omm, m, TEST_ENTRIES + 1);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_bulk_performance()
+{
+    void *m[TEST_ITERATIONS];
+    uint64_t start;
+    int i;
+
+    start = get_time_us();
+    for (i = 0; i < TEST_ITERATIONS_BIG / TEST_ITERATIONS; i++) {
+        omalloc_bulk(omm, 8, TEST_ITERATIONS, m);
+        omfree_bulk(omm, m, TEST_ITERATIONS);
+    }
+    printf("%" PRIu64 "us ... ", (get_time_us() - start));
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_best_fit()
+{
+    size_t sizes[] = { 512 * 1024, 256 * 1024, 384 * 1024, 320 * 1024 };
+    void *holes[4];
+    void *guards[4];
+    void *m;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        holes[i] = omalloc(omm, sizes[i]);
+        guards[i] = omalloc(omm, 8);
+    }
+    for (i = 0; i < 4; i++)
+        omfree(omm, holes[i]);
+    /* The tightest hole wins over the first or largest */
+    CU_ASSERT((m = omalloc(omm, 300 * 1024)) == holes[3]);
+    omfree(omm, m);
+    CU_ASSERT((m = omalloc(omm, 330 * 1024)) == holes[2]);
+    omfree(omm, m);
+    CU_ASSERT((m = omalloc(omm, 200 * 1024)) == holes[1]);
+    omfree(omm, m);
+    for (i = 0; i < 4; i++)
+        omfree(omm, guards[i]);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_large_random()
+{
+    void *m[16] = { NULL };
+    int i, j;
+
+    /* At most 3MB is live so a large enough hole always remains */
+    for (i = 0; i < TEST_ITERATIONS; i++) {
+        j = rand() % 16;
+        if (m[j]) {
+            omfree(omm, m[j]);
+            m[j] = NULL;
+        } else {
+            size_t size = 64 * 1024 + rand() % (128 * 1024);
+            CU_ASSERT((m[j] = omalloc(omm, size)) != NULL);
+            memset(m[j], j, size);
+        }
+    }
+    for (j = 0; j < 16; j++)
+        omfree(omm, m[j]);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
 void test_malloc_until_fail()
 {
-    GList *mlist = NULL;
-    GList *iter;
-    while (1) {
-        size_t size = rand() % ((16 * 1024) - (2 * 2 * sizeof(size_t)));
-        if (omavailable(omm) < size)
-            break;
-        void *m = omalloc(omm, size);
-        mlist = g_list_prepend(mlist, m);
+    GList *mlist = NULL;
+    GList *iter;
+    while (1) {
+        size_t size = rand() % ((16 * 1024) - (2 * 2 * sizeof(size_t)));
+        if (omavailable(omm) < size)
+            break;
+        void *m = omalloc(omm, size);
+        mlist = g_list_prepend(mlist, m);
+    }
+    omstats(omm);
+    for (iter = mlist; iter; iter = g_list_next(iter))
+        omfree(omm, iter->data);
+    g_list_free(mlist);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_malloc_performance()
+{
+    GList *allocated = NULL;
+    uint64_t start;
+    GList *iter;
+    int i;
+
+    start = get_time_us();
+    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
+        allocated = g_list_prepend(allocated, omalloc(omm, 8));
+    }
+    for (iter = allocated; iter; iter = iter->next) {
+        omfree(omm, iter->data);
+    }
+    printf("%" PRIu64 "us ... ", (get_time_us() - start));
+    g_list_free(allocated);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_glib_malloc_performance()
+{
+    GList *allocated = NULL;
+    uint64_t start;
+    GList *iter;
+    int i;
+
+    start = get_time_us();
+    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
+        allocated = g_list_prepend(allocated, g_malloc(64));
+    }
+    for (iter = allocated; iter; iter = iter->next) {
+        g_free(iter->data);
+    }
+    printf("%" PRIu64 "us ... ", (get_time_us() - start));
+    g_list_free(allocated);
+}
+
+void test_malloc_performance_fragmented()
+{
+    GList *fragments = NULL;
+    GList *allocated = NULL;
+    uint64_t start;
+    GList *iter;
+    int i;
+
+    for (i = 0; i < (TEST_HEAP_SIZE / 50); i += 64) {
+        fragments = g_list_prepend(fragments, omalloc(omm, 64));
+        omfree(omm, omalloc(omm, 64));
+    }
+    start = get_time_us();
+    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
+        allocated = g_list_prepend(allocated, omalloc(omm, 64));
+    }
+    for (iter = allocated; iter; iter = iter->next) {
+        omfree(omm, iter->data);
+    }
+    printf("%" PRIu64 "us ... ", (get_time_us() - start));
+    g_list_free(allocated);
+    for (iter = fragments; iter; iter = iter->next) {
+        omfree(omm, iter->data);
+    }
+    g_list_free(fragments);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+static om_block *locked_create(void)
+{
+    om_options opts = {.flags = OM_LOCKED };
+    char *cmd;
+
+    cmd = g_strdup_printf("touch %s", TEST_LOCK_FNAME);
+    if (system(cmd));
+    g_free(cmd);
+    cmd = g_strdup_printf("ipcrm -M 0x%08x 2>/dev/null", ftok(TEST_LOCK_FNAME, 'R'));
+    if (system(cmd));
+    g_free(cmd);
+    return omcreate_opts(TEST_LOCK_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+}
+
+static void locked_destroy(om_block * om)
+{
+    shmctl(om->shmid, IPC_RMID, NULL);
+    omdestroy(om);
+    unlink(TEST_LOCK_FNAME);
+}
+
+void test_locked_recursive()
+{
+    om_block *om = locked_create();
+    void *m;
+    CU_ASSERT(om != NULL);
+    omlock(om);
+    CU_ASSERT((m = omalloc(om, 64)) != 0);
+    omfree(om, m);
+    omunlock(om);
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE);
+    locked_destroy(om);
+}
+
+void test_locked_processes()
+{
+    om_block *om = locked_create();
+    pid_t pids[TEST_PROCESSES];
+    int i, j, status;
+
+    for (i = 0; i < TEST_PROCESSES; i++) {
+        if ((pids[i] = fork()) == 0) {
+            void *m[64];
+            for (j = 0; j < TEST_ITERATIONS * 64; j++) {
+                if (j >= 64)
+                    omfree(om, m[j % 64]);
+                m[j % 64] = omalloc(om, 8 + (rand() % 256));
+            }
+            for (j = 0; j < 64; j++)
+                omfree(om, m[j]);
+            _exit(0);
+        }
+    }
+    for (i = 0; i < TEST_PROCESSES; i++) {
+        CU_ASSERT(waitpid(pids[i], &status, 0) == pids[i]);
+        CU_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE);
+    locked_destroy(om);
+}
+
+void test_locked_owner_died()
+{
+    om_block *om = locked_create();
+    pid_t pid;
+    void *m;
+
+    if ((pid = fork()) == 0) {
+        omlock(om);
+        omalloc(om, 64);
+        _exit(0);
+    }
+    CU_ASSERT(waitpid(pid, NULL, 0) == pid);
+    CU_ASSERT((m = omalloc(om, 64)) != 0);
+    omfree(om, m);
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE - 72);
+    locked_destroy(om);
+}
+
+void test_cached_reuse()
+{
+    om_options opts = {.flags = OM_CACHED };
+    om_block *om = omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    size_t available = omavailable(om);
+    void *m1, *m2;
+
+    CU_ASSERT((m1 = omalloc(om, 64)) != 0);
+    omfree(om, m1);
+    CU_ASSERT(omavailable(om) < available);
+    CU_ASSERT((m2 = omalloc(om, 64)) == m1);
+    omfree(om, m2);
+    omcache_flush(om);
+    CU_ASSERT(omavailable(om) == available);
+    omdestroy(om);
+}
+
+void test_cached_overflow()
+{
+    om_options opts = {.flags = OM_CACHED };
+    om_block *om = omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    size_t available = omavailable(om);
+    void *m[TEST_ENTRIES];
+    int i;
+
+    for (i = 0; i < TEST_ENTRIES; i++)
+        CU_ASSERT((m[i] = omalloc(om, 8 + (i % 256))) != 0);
+    for (i = 0; i < TEST_ENTRIES; i++)
+        omfree(om, m[i]);
+    CU_ASSERT(omavailable(om) > available - (TEST_HEAP_SIZE / 100));
+    omcache_flush(om);
+    CU_ASSERT(omavailable(om) == available);
+    omdestroy(om);
+}
+
+static void *cached_thread(void *data)
+{
+    om_block *om = (om_block *) data;
+    void *m[64];
+    int i;
+
+    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
+        if (i >= 64)
+            omfree(om, m[i % 64]);
+        m[i % 64] = omalloc(om, 32 + (i % 96));
+    }
+    for (i = 0; i < 64; i++)
+        omfree(om, m[i]);
+    omcache_flush(om);
+    return NULL;
+}
+
+void test_cached_threads()
+{
+    om_options opts = {.flags = OM_LOCKED | OM_CACHED };
+    om_block *om = omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    size_t available = omavailable(om);
+    pthread_t threads[TEST_PROCESSES];
+    uint64_t start;
+    int i;
+
+    start = get_time_us();
+    for (i = 0; i < TEST_PROCESSES; i++)
+        pthread_create(&threads[i], NULL, cached_thread, om);
+    for (i = 0; i < TEST_PROCESSES; i++)
+        pthread_join(threads[i], NULL);
+    printf("%" PRIu64 "us ... ", (get_time_us() - start));
+    CU_ASSERT(omavailable(om) == available);
+    omdestroy(om);
+}
+
+typedef struct epoch_reader_args {
+    om_block *om;
+    pthread_barrier_t barrier;
+} epoch_reader_args;
+
+static void *epoch_reader(void *arg)
+{
+    epoch_reader_args *r = arg;
+
+    CU_ASSERT(omepoch_enter(r->om));
+    pthread_barrier_wait(&r->barrier);
+    pthread_barrier_wait(&r->barrier);
+    omepoch_exit(r->om);
+    return NULL;
+}
+
+void test_epoch_reclaim()
+{
+    om_block *om = locked_create();
+    epoch_reader_args r = {.om = om };
+    omhtree tree = { };
+    pthread_t thread;
+    size_t available;
+    omhtree *node;
+    char *m;
+    int i;
+
+    /* Nothing serialises the reader table on heaps without the lock */
+    CU_ASSERT((m = omalloc(omm, 64)) != NULL);
+    CU_ASSERT(!omepoch_enter(omm));
+    CU_ASSERT(!omfree_deferred(omm, m));
+    omfree(omm, m);
+    CU_ASSERT(omm->epochs == 0);
+
+    /* Without readers, blocks go once the epoch has moved on */
+    omfree_deferred(om, omalloc(om, 64));
+    available = omavailable(om);
+    CU_ASSERT(omepoch_reclaim(om) == 1);
+    CU_ASSERT(omavailable(om) == available + 72);
+    CU_ASSERT(omepoch_reclaim(om) == 0);
+
+    /* Readers hold back blocks queued while they are inside */
+    CU_ASSERT(omepoch_enter(om));
+    CU_ASSERT(omepoch_enter(om));
+    omfree_deferred(om, omalloc(om, 64));
+    omepoch_exit(om);
+    CU_ASSERT(omepoch_reclaim(om) == 0);
+    omepoch_exit(om);
+    CU_ASSERT(omepoch_reclaim(om) == 1);
+
+    pthread_barrier_init(&r.barrier, NULL, 2);
+    CU_ASSERT(pthread_create(&thread, NULL, epoch_reader, &r) == 0);
+    pthread_barrier_wait(&r.barrier);
+    omfree_deferred(om, omalloc(om, 64));
+    CU_ASSERT(omepoch_reclaim(om) == 0);
+    CU_ASSERT(omepoch_reclaim(om) == 0);
+    pthread_barrier_wait(&r.barrier);
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&r.barrier);
+    CU_ASSERT(omepoch_reclaim(om) == 1);
+
+    /* Batches are reclaimed as they are queued */
+    for (i = 0; i < OMEPOCH_BATCH * 4; i++)
+        omfree_deferred(om, omalloc(om, 64));
+    CU_ASSERT(omepoch_reclaim(om) == 0);
+
+    /* Hash tree nodes stay readable until the reader leaves */
+    CU_ASSERT(omepoch_enter(om));
+    node = omhtree_add(om, &tree, "/test/node", sizeof(omhtree));
+    CU_ASSERT(node != NULL);
+    available = omavailable(om);
+    omhtree_delete(om, &tree, node);
+    CU_ASSERT(omavailable(om) == available);
+    CU_ASSERT(node->key && strcmp((char *) om + node->key, "node") == 0);
+    omepoch_exit(om);
+    CU_ASSERT(omepoch_reclaim(om) > 0);
+    CU_ASSERT(omavailable(om) > available);
+    CU_ASSERT(omcheck(om, 0, 0) == 0);
+    locked_destroy(om);
+}
+
+void test_epoch_processes()
+{
+    om_block *om = locked_create();
+    int ready[2], done[2];
+    pid_t pid;
+    char c;
+
+    omfree_deferred(om, omalloc(om, 64));
+    CU_ASSERT(omepoch_reclaim(om) == 1);
+
+    /* A reader in another process */
+    CU_ASSERT(pipe(ready) == 0 && pipe(done) == 0);
+    if ((pid = fork()) == 0) {
+        omepoch_enter(om);
+        CU_ASSERT(write(ready[1], "r", 1) == 1);
+        CU_ASSERT(read(done[0], &c, 1) == 1);
+        omepoch_exit(om);
+        _exit(0);
+    }
+    CU_ASSERT(read(ready[0], &c, 1) == 1);
+    omfree_deferred(om, omalloc(om, 64));
+    CU_ASSERT(omepoch_reclaim(om) == 0);
+    CU_ASSERT(write(done[1], "d", 1) == 1);
+    CU_ASSERT(waitpid(pid, NULL, 0) == pid);
+    CU_ASSERT(omepoch_reclaim(om) == 1);
+
+    /* A reader that died inside does not hold blocks back */
+    if ((pid = fork()) == 0) {
+        omepoch_enter(om);
+        _exit(0);
+    }
+    CU_ASSERT(waitpid(pid, NULL, 0) == pid);
+    omfree_deferred(om, omalloc(om, 64));
+    CU_ASSERT(omepoch_reclaim(om) == 1);
+    close(ready[0]);
+    close(ready[1]);
+    close(done[0]);
+    close(done[1]);
+    locked_destroy(om);
+}
+
+void test_slab_alloc_free()
+{
+    omslab *slab = omslab_create(omm, sizeof(omhtree));
+    void *m1, *m2;
+    CU_ASSERT(slab != NULL);
+    CU_ASSERT((m1 = omslab_alloc(omm, slab)) != NULL);
+    CU_ASSERT((m2 = omslab_alloc(omm, slab)) != NULL);
+    CU_ASSERT(m1 != m2);
+    omslab_free(omm, slab, m1);
+    CU_ASSERT(omslab_alloc(omm, slab) == m1);
+    omslab_free(omm, slab, m1);
+    omslab_free(omm, slab, m2);
+    omslab_destroy(omm, slab);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_slab_bad_size()
+{
+    CU_ASSERT(omslab_create(omm, 0) == NULL);
+    CU_ASSERT(omslab_create(omm, OMSLAB_PAGE_SIZE) == NULL);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_slab_many_pages()
+{
+    omslab *slab = omslab_create(omm, 24);
+    GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GList *allocated = NULL;
+    GList *iter;
+    int i;
+
+    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
+        void *m = omslab_alloc(omm, slab);
+        CU_ASSERT(g_hash_table_lookup(seen, m) == NULL);
+        g_hash_table_insert(seen, m, m);
+        allocated = g_list_prepend(allocated, m);
+    }
+    for (iter = allocated; iter; iter = iter->next)
+        omslab_free(omm, slab, iter->data);
+    g_list_free(allocated);
+    g_hash_table_destroy(seen);
+    omslab_destroy(omm, slab);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+static void *slab_thread(void *data)
+{
+    omslab *slab = (omslab *) data;
+    uint64_t *m[64];
+    intptr_t errors = 0;
+    int i;
+
+    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
+        if (i >= 64) {
+            if (*m[i % 64] != (uint64_t) (uintptr_t) m[i % 64])
+                errors++;
+            omslab_free(omm, slab, m[i % 64]);
+        }
+        m[i % 64] = omslab_alloc(omm, slab);
+        *m[i % 64] = (uint64_t) (uintptr_t) m[i % 64];
+    }
+    for (i = 0; i < 64; i++)
+        omslab_free(omm, slab, m[i]);
+    return (void *) errors;
+}
+
+void test_slab_threads()
+{
+    omslab *slab = omslab_create(omm, 64);
+    pthread_t threads[TEST_PROCESSES];
+    uint64_t start;
+    int i;
+
+    start = get_time_us();
+    for (i = 0; i < TEST_PROCESSES; i++)
+        pthread_create(&threads[i], NULL, slab_thread, slab);
+    for (i = 0; i < TEST_PROCESSES; i++) {
+        void *errors;
+        pthread_join(threads[i], &errors);
+        CU_ASSERT(errors == NULL);
+    }
+    printf("%" PRIu64 "us ... ", (get_time_us() - start));
+    omslab_destroy(omm, slab);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+static void backend_shared(unsigned int flags, const char *fname)
+{
+    om_options opts = {.flags = flags };
+    om_block *om1, *om2;
+    char *m, *m2;
+
+    CU_ASSERT((om1 = omcreate_opts(fname, TEST_HEAP_SIZE, TEST_HEADROOM, &opts)) != NULL);
+    CU_ASSERT((om2 = omcreate_opts(fname, TEST_HEAP_SIZE, TEST_HEADROOM, &opts)) != NULL);
+    CU_ASSERT(om1 != om2);
+    CU_ASSERT((m = omalloc(om1, 32)) != NULL);
+    strcpy(m, "shared");
+    m2 = omo2p(om2, omp2o(om1, m));
+    CU_ASSERT(strcmp(m2, "shared") == 0);
+    omfree(om2, m2);
+    CU_ASSERT(omavailable(om1) == TEST_HEAP_SIZE);
+    omdestroy(om2);
+    CU_ASSERT((om2 = omattach(fname, flags & (OM_SHM | OM_FILE))) != NULL);
+    CU_ASSERT(om2->size == TEST_HEAP_SIZE && om2->headroom == TEST_HEADROOM);
+    CU_ASSERT((m = omalloc(om2, 32)) != NULL);
+    omfree(om1, omo2p(om1, omp2o(om2, m)));
+    CU_ASSERT(omavailable(om2) == TEST_HEAP_SIZE);
+    omdestroy(om2);
+    omdestroy(om1);
+}
+
+void test_backend_attach_sysv()
+{
+    om_block *om;
+
+    CU_ASSERT((om = omattach(TEST_SHM_FNAME, 0)) != NULL);
+    CU_ASSERT(om != omm && om->size == TEST_HEAP_SIZE);
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE);
+    omdestroy(om);
+    CU_ASSERT(omattach("/tmp/omem_test.missing", 0) == NULL);
+    CU_ASSERT(omattach("/tmp/omem_test.missing", OM_FILE) == NULL);
+}
+
+void test_backend_file()
+{
+    unlink(TEST_HEAP_FNAME);
+    backend_shared(OM_FILE, TEST_HEAP_FNAME);
+    unlink(TEST_HEAP_FNAME);
+}
+
+void test_backend_shm()
+{
+    om_options opts = {.flags = OM_SHM | OM_HUGETLB };
+
+    shm_unlink(TEST_POSIX_SHM);
+    CU_ASSERT(omcreate_opts(TEST_POSIX_SHM, TEST_HEAP_SIZE, TEST_HEADROOM, &opts) == NULL);
+    backend_shared(OM_SHM | OM_THP, TEST_POSIX_SHM);
+    shm_unlink(TEST_POSIX_SHM);
+}
+
+void test_backend_memfd()
+{
+    om_options opts = {.flags = OM_MEMFD | OM_LOCKED };
+    om_block *om = omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    char *m;
+    pid_t pid;
+
+    CU_ASSERT(om != NULL);
+    CU_ASSERT((m = omalloc(om, 32)) != NULL);
+    if ((pid = fork()) == 0) {
+        strcpy(m, "child");
+        omfree(om, omalloc(om, 64));
+        _exit(0);
+    }
+    CU_ASSERT(waitpid(pid, NULL, 0) == pid);
+    CU_ASSERT(strcmp(m, "child") == 0);
+    omfree(om, m);
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE);
+    omdestroy(om);
+}
+
+void test_backend_private_thp()
+{
+    om_options opts = {.flags = OM_THP };
+    om_block *om = omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    CU_ASSERT(om != NULL);
+    CU_ASSERT(om->flags & OM_PRIVATE);
+    omfree(om, omalloc(om, 1024));
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE);
+    omdestroy(om);
+}
+
+void test_backend_incompatible()
+{
+    om_options opts = {.flags = OM_FILE };
+    om_block *om;
+
+    unlink(TEST_HEAP_FNAME);
+    om = omcreate_opts(TEST_HEAP_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    CU_ASSERT(om != NULL);
+    CU_ASSERT(omcreate_opts(TEST_HEAP_FNAME, TEST_HEAP_SIZE / 2, TEST_HEADROOM, &opts)
+              == NULL);
+    CU_ASSERT(omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, &opts) == NULL);
+    omdestroy(om);
+    unlink(TEST_HEAP_FNAME);
+}
+
+static void backend_growable(unsigned int flags, const char *fname)
+{
+    om_options opts = {.flags = flags | OM_GROWABLE,.maxsize = TEST_HEAP_SIZE * 4 };
+    om_block *om1, *om2;
+    void *m1, *m2;
+    char *m3;
+
+    CU_ASSERT((om1 = omcreate_opts(fname, TEST_HEAP_SIZE, TEST_HEADROOM, &opts)) != NULL);
+    CU_ASSERT((m1 = omalloc(om1, TEST_HEAP_SIZE / 2)) != NULL);
+    CU_ASSERT((m2 = omalloc(om1, TEST_HEAP_SIZE)) != NULL);
+    CU_ASSERT(om1->size > TEST_HEAP_SIZE && om1->size <= opts.maxsize);
+    memset(m2, 0x5a, TEST_HEAP_SIZE);
+    if (fname) {
+        om2 = omcreate_opts(fname, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+        CU_ASSERT(om2 != NULL);
+        m3 = omo2p(om2, omp2o(om1, m2));
+        CU_ASSERT(m3[TEST_HEAP_SIZE - 1] == 0x5a);
+        omfree(om2, m3);
+        omdestroy(om2);
+    } else {
+        omfree(om1, m2);
     }
-    omstats(omm);
-    for (iter = mlist; iter; iter = g_list_next(iter))
-        omfree(omm, iter->data);
-    g_list_free(mlist);
+    omfree(om1, m1);
+    CU_ASSERT(omavailable(om1) == om1->size);
+    omdestroy(om1);
+}
+
+void test_backend_grow_file()
+{
+    unlink(TEST_HEAP_FNAME);
+    backend_growable(OM_FILE, TEST_HEAP_FNAME);
+    unlink(TEST_HEAP_FNAME);
+}
+
+void test_backend_grow_private()
+{
+    backend_growable(0, NULL);
+}
+
+void test_backend_grow_sysv()
+{
+    om_options opts = {.flags = OM_GROWABLE,.maxsize = TEST_HEAP_SIZE * 4 };
+    CU_ASSERT(omcreate_opts(TEST_SHM_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts) == NULL);
+}
+
+#define TEST_RELEASE_SIZE (1024 * 1024)
+
+static void backend_release(unsigned int flags, const char *fname)
+{
+    om_options opts = {.flags = flags | OM_RELEASE,.release = 1 };
+    size_t pgsz = sysconf(_SC_PAGE_SIZE);
+    unsigned char vec[TEST_RELEASE_SIZE / 4096];
+    uint8_t *m, *m2, *lo;
+    size_t i, len, resident = 0;
+    om_block *om;
+
+    CU_ASSERT((om = omcreate_opts(fname, TEST_HEAP_SIZE, TEST_HEADROOM, &opts)) != NULL);
+    CU_ASSERT((m = omalloc(om, TEST_RELEASE_SIZE)) != NULL);
+    CU_ASSERT((m2 = omalloc(om, 64)) != NULL);
+    memset(m, 0xaa, TEST_RELEASE_SIZE);
+    omfree(om, m);
+
+    /* Only the partial pages at either end stay resident */
+    lo = (uint8_t *) (((size_t) m + pgsz) & ~(pgsz - 1));
+    len = TEST_RELEASE_SIZE - 2 * pgsz;
+    CU_ASSERT(mincore(lo, len, vec) == 0);
+    for (i = 0; i < len / pgsz; i++)
+        resident += vec[i] & 1;
+    CU_ASSERT(resident == 0);
+
+    /* The released block is known-zero and is reused as is */
+    CU_ASSERT(omcalloc(om, 1, TEST_RELEASE_SIZE) == m);
+    for (i = 0; i < TEST_RELEASE_SIZE && !m[i]; i++);
+    CU_ASSERT(i == TEST_RELEASE_SIZE);
+    omfree(om, m);
+    omfree(om, m2);
+    CU_ASSERT(omavailable(om) == TEST_HEAP_SIZE);
+    omdestroy(om);
+}
+
+void test_backend_release_private()
+{
+    backend_release(0, NULL);
+}
+
+void test_backend_release_memfd()
+{
+    backend_release(OM_MEMFD, NULL);
+}
+
+void test_backend_release_shm()
+{
+    shm_unlink(TEST_POSIX_SHM);
+    backend_release(OM_SHM, TEST_POSIX_SHM);
+    shm_unlink(TEST_POSIX_SHM);
+}
+
+static void *attach_thread(void *arg)
+{
+    om_options opts = {.flags = OM_FILE };
+    return omcreate_opts(TEST_HEAP_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+}
+
+void test_backend_attach_wait()
+{
+    size_t pgsz = sysconf(_SC_PAGE_SIZE);
+    pthread_t thread;
+    om_block *hdr;
+    void *ret;
+    int fd;
+
+    /* Play the part of a creator that fails after attachers arrive */
+    unlink(TEST_HEAP_FNAME);
+    CU_ASSERT((fd = open(TEST_HEAP_FNAME, O_RDWR | O_CREAT | O_EXCL, 0644)) >= 0);
+    CU_ASSERT(ftruncate(fd, pgsz) == 0);
+    hdr = mmap(NULL, pgsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    CU_ASSERT(hdr != MAP_FAILED);
+    CU_ASSERT(pthread_create(&thread, NULL, attach_thread, NULL) == 0);
+    usleep(10000);
+    hdr->magic = OM_MAGIC;
+    hdr->version = OM_VERSION;
+    __atomic_store_n(&hdr->state, OM_STATE_FAILED, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &hdr->state, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    CU_ASSERT(pthread_join(thread, &ret) == 0);
+    CU_ASSERT(ret == NULL);
+
+    /* Other layouts are turned away without waiting */
+    hdr->state = OM_STATE_INIT;
+    hdr->version = OM_VERSION + 1;
+    CU_ASSERT(omattach(TEST_HEAP_FNAME, OM_FILE) == NULL);
+    CU_ASSERT(attach_thread(NULL) == NULL);
+    hdr->magic = 1;
+    hdr->version = 0;
+    CU_ASSERT(attach_thread(NULL) == NULL);
+    munmap(hdr, pgsz);
+    close(fd);
+    unlink(TEST_HEAP_FNAME);
+}
+
+static size_t resident_pages(void *start, size_t len)
+{
+    size_t pgsz = sysconf(_SC_PAGE_SIZE), pages = len / pgsz, count = 0, i;
+    unsigned char *vec = malloc(pages);
+
+    if (mincore(start, pages * pgsz, vec) == 0) {
+        for (i = 0; i < pages; i++)
+            count += vec[i] & 1;
+    }
+    free(vec);
+    return count;
+}
+
+void test_backend_warm_sysv()
+{
+    om_options opts = {.flags = OM_PREFAULT | OM_MLOCK };
+    size_t len = sizeof(om_block) + TEST_HEADROOM + TEST_HEAP_SIZE;
+    om_block *om;
+
+    om = omcreate_opts(TEST_SHM_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    CU_ASSERT(om != NULL && om != omm && om->flags == omm->flags);
+    CU_ASSERT(resident_pages(om, len) == len / sysconf(_SC_PAGE_SIZE));
+    omdestroy(om);
     CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
 }
 
-void test_malloc_performance()
+void test_backend_warm_file()
+{
+    om_options opts = {.flags = OM_FILE };
+    size_t len = sizeof(om_block) + TEST_HEADROOM + TEST_HEAP_SIZE;
+    om_block *om1, *om2;
+
+    unlink(TEST_HEAP_FNAME);
+    om1 = omcreate_opts(TEST_HEAP_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    CU_ASSERT(om1 != NULL);
+    CU_ASSERT((om2 = omattach(TEST_HEAP_FNAME, OM_FILE | OM_POPULATE)) != NULL);
+    CU_ASSERT(resident_pages(om2, len) == len / sysconf(_SC_PAGE_SIZE));
+    omdestroy(om2);
+    opts.flags |= OM_PREFAULT;
+    om2 = omcreate_opts(TEST_HEAP_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    CU_ASSERT(om2 != NULL && om2->flags == om1->flags);
+    omdestroy(om2);
+    omdestroy(om1);
+    unlink(TEST_HEAP_FNAME);
+}
+
+void test_backend_persist_file()
+{
+    om_options opts = {.flags = OM_FILE };
+    om_block *om, *om2, hdr;
+    uint64_t seq, *map;
+    size_t page;
+    char *m;
+    int fd;
+
+    CU_ASSERT(!ompersist_start(omm, 0, 0));
+    unlink(TEST_HEAP_FNAME);
+    om = omcreate_opts(TEST_HEAP_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    CU_ASSERT(om != NULL);
+    CU_ASSERT(ompersist_sync(om) == 0);
+    CU_ASSERT(ompersist_start(om, 0, 50));
+    CU_ASSERT(om->dirty != 0 && om->persister == (uint32_t) getpid());
+    CU_ASSERT(!ompersist_start(om, 0, 50));
+    /* Only one process (or mapping) persists a heap at a time */
+    CU_ASSERT((om2 = omattach(TEST_HEAP_FNAME, OM_FILE)) != NULL);
+    CU_ASSERT(!ompersist_start(om2, 0, 0));
+
+    CU_ASSERT((m = omalloc(om, 10000)) != NULL);
+    memset(m, 0x5a, 10000);
+    ommark_dirty(om, m, 10000);
+    /* Ranges are cut at the end of the segment */
+    ommark_dirty(om, m, SIZE_MAX / 2);
+    ommark_dirty(om, (char *) om - 4096, 100);
+    seq = ompersist_sync(om);
+    CU_ASSERT(seq > 0 && om->checkpoint == seq);
+    CU_ASSERT(ompersist_sync(om) == seq + 1);
+    /* The marker is stored in the file */
+    CU_ASSERT((fd = open(TEST_HEAP_FNAME, O_RDONLY)) >= 0);
+    CU_ASSERT(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+    CU_ASSERT(hdr.checkpoint == seq + 1);
+    close(fd);
+    /* Checkpoints are also made every interval */
+    usleep(200000);
+    CU_ASSERT(om->checkpoint > seq + 1);
+    seq = om->checkpoint;
+    omfree(om, m);
+    ompersist_stop(om);
+    CU_ASSERT(om->checkpoint > seq && om->persister == 0);
+    CU_ASSERT(ompersist_sync(om) == 0);
+    /* Nothing is marked once stopped */
+    CU_ASSERT((m = omalloc(om, 10000)) != NULL);
+    map = omo2p(om, om->dirty);
+    page = ((size_t) m - (size_t) om) >> 12;
+    map[page / 64] = 0;
+    ommark_dirty(om, m, 100);
+    omfree(om, m);
+    CU_ASSERT(map[page / 64] == 0);
+
+    CU_ASSERT(ompersist_start(om2, 0, 0));
+    CU_ASSERT(ompersist_sync(om2) == om2->checkpoint);
+    omdestroy(om2);
+    CU_ASSERT(om->persister == 0);
+    omdestroy(om);
+    unlink(TEST_HEAP_FNAME);
+}
+
+#define TEST_BAD_SNAPSHOT "/tmp/omem_test.bad.snap"
+
+void test_backend_restore_file()
+{
+    om_options opts = {.flags = OM_FILE | OM_LOCKED | OM_CACHED };
+    struct omstats stats;
+    om_block *om;
+    char *m;
+    int fd;
+
+    unlink(TEST_HEAP_FNAME);
+    om = omcreate_opts(TEST_HEAP_FNAME, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    CU_ASSERT(om != NULL);
+    CU_ASSERT(ompersist_start(om, 0, 0));
+    ompersist_stop(om);
+    CU_ASSERT(omprofile_start(om, 1, 0));
+    CU_ASSERT(omepoch_enter(om));
+    CU_ASSERT((m = omalloc(om, 100)) != NULL);
+    omfree(om, m);
+    omfree_deferred(om, omalloc(om, 64));
+    CU_ASSERT(omsnapshot(om, TEST_SNAPSHOT));
+    CU_ASSERT(omsnapshot(om, TEST_BAD_SNAPSHOT));
+    omepoch_exit(om);
+    omdestroy(om);
+    unlink(TEST_HEAP_FNAME);
+
+    /* A damaged snapshot is refused before the segment is made */
+    CU_ASSERT((fd = open(TEST_BAD_SNAPSHOT, O_RDWR)) >= 0);
+    CU_ASSERT(ftruncate(fd, lseek(fd, 0, SEEK_END) - 8) == 0);
+    close(fd);
+    CU_ASSERT(omrestore(TEST_BAD_SNAPSHOT, TEST_HEAP_FNAME) == NULL);
+    CU_ASSERT(access(TEST_HEAP_FNAME, F_OK) != 0);
+
+    /* State owned by the old processes is dropped. What is left in use
+     * is the cache table, the reader table and its empty queue. */
+    CU_ASSERT((om = omrestore(TEST_SNAPSHOT, TEST_HEAP_FNAME)) != NULL);
+    CU_ASSERT(om->profile == 0 && om->sampling == 0 && om->dirty == 0);
+    CU_ASSERT(omepoch_reclaim(om) == 0);
+    omstats_get(om, &stats);
+    CU_ASSERT(stats.used_blocks == 3);
+    CU_ASSERT(omcheck(om, 0, 0) == 0);
+    omdestroy(om);
+    CU_ASSERT((om = omattach(TEST_HEAP_FNAME, OM_FILE)) != NULL);
+    omdestroy(om);
+    unlink(TEST_HEAP_FNAME);
+    unlink(TEST_SNAPSHOT);
+    unlink(TEST_BAD_SNAPSHOT);
+}
+
+void test_handle_alloc_free()
 {
-    GList *allocated = NULL;
-    uint64_t start;
-    GList *iter;
-    int i;
+    omhandle h;
+    char *m;
 
-    start = get_time_us();
-    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
-        allocated = g_list_prepend(allocated, omalloc(omm, 8));
+    CU_ASSERT(omhalloc(omm, 0) == 0);
+    CU_ASSERT(omhptr(omm, 0) == NULL);
+    CU_ASSERT((h = omhalloc(omm, 100)) != 0);
+    CU_ASSERT((m = omhptr(omm, h)) != NULL);
+    strcpy(m, "hello world");
+    omhfree(omm, h);
+    CU_ASSERT(omhptr(omm, h) == NULL);
+    omhfree(omm, h);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+#define TEST_HANDLES 4096
+
+static void handle_fill(omhandle h, int i, size_t size)
+{
+    memset(omhptr(omm, h), i & 0xff, size);
+}
+
+static bool handle_check(omhandle h, int i, size_t size)
+{
+    uint8_t *m = omhptr(omm, h);
+    while (size--) {
+        if (*m++ != (i & 0xff))
+            return false;
     }
-    for (iter = allocated; iter; iter = iter->next) {
-        omfree(omm, iter->data);
+    return true;
+}
+
+void test_handle_compact()
+{
+    omhandle h[60];
+    void *big;
+    int i, calls = 0;
+
+    /* Fill half the heap, then leave it full of holes */
+    for (i = 0; i < 60; i++) {
+        CU_ASSERT((h[i] = omhalloc(omm, 1 + (i * 7919) % 100000)) != 0);
+        handle_fill(h[i], i, 1 + (i * 7919) % 100000);
+    }
+    for (i = 0; i < 60; i += 2)
+        omhfree(omm, h[i]);
+    while (omcompact(omm, 64 * 1024))
+        calls++;
+    CU_ASSERT(calls > 1);
+    CU_ASSERT(omcompact(omm, SIZE_MAX) == false);
+
+    /* All the free space is now in one block at the end */
+    CU_ASSERT((big = omalloc(omm, omavailable(omm) - 64)) != NULL);
+    omfree(omm, big);
+    for (i = 1; i < 60; i += 2) {
+        CU_ASSERT(handle_check(h[i], i, 1 + (i * 7919) % 100000));
+        omhfree(omm, h[i]);
     }
-    printf("%" PRIu64 "us ... ", (get_time_us() - start));
-    g_list_free(allocated);
     CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
 }
 
-void test_glib_malloc_performance()
+void test_handle_compact_interleaved()
 {
-    GList *allocated = NULL;
-    uint64_t start;
-    GList *iter;
-    int i;
+    omhandle *h = calloc(TEST_HANDLES, sizeof(omhandle));
+    void *m[64] = { NULL };
+    int i, j;
 
-    start = get_time_us();
-    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
-        allocated = g_list_prepend(allocated, g_malloc(64));
+    for (i = 0; i < TEST_ITERATIONS * 4; i++) {
+        j = rand() % TEST_HANDLES;
+        if (h[j]) {
+            CU_ASSERT(handle_check(h[j], j, 1 + j % 700));
+            omhfree(omm, h[j]);
+            h[j] = 0;
+        } else {
+            CU_ASSERT((h[j] = omhalloc(omm, 1 + j % 700)) != 0);
+            handle_fill(h[j], j, 1 + j % 700);
+        }
+        j = rand() % 64;
+        if (m[j]) {
+            omfree(omm, m[j]);
+            m[j] = NULL;
+        } else {
+            m[j] = omalloc(omm, 1 + rand() % 300);
+        }
+        omcompact(omm, 4096);
     }
-    for (iter = allocated; iter; iter = iter->next) {
-        g_free(iter->data);
+    for (j = 0; j < 64; j++)
+        omfree(omm, m[j]);
+    for (j = 0; j < TEST_HANDLES; j++) {
+        if (h[j]) {
+            CU_ASSERT(handle_check(h[j], j, 1 + j % 700));
+            omhfree(omm, h[j]);
+        }
     }
-    printf("%" PRIu64 "us ... ", (get_time_us() - start));
-    g_list_free(allocated);
+    free(h);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
 }
 
-void test_malloc_performance_fragmented()
+int suite_init_buddy(void)
 {
-    GList *fragments = NULL;
-    GList *allocated = NULL;
-    uint64_t start;
-    GList *iter;
+    om_options opts = {.flags = OM_BUDDY | OM_LOCKED };
+    omm = omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    return omm ? 0 : -1;
+}
+
+int suite_shutdown_buddy(void)
+{
+    omdestroy(omm);
+    return 0;
+}
+
+void test_buddy_split_merge()
+{
+    uint8_t *m1, *m2, *m3;
+    CU_ASSERT((m1 = omalloc(omm, 100)) != NULL);
+    CU_ASSERT((m2 = omalloc(omm, 100)) != NULL);
+    CU_ASSERT((m3 = omalloc(omm, 200)) != NULL);
+    CU_ASSERT(m2 == m1 + 128);
+    CU_ASSERT(m3 == m1 + 256);
+    omfree(omm, m2);
+    omfree(omm, m1);
+    omfree(omm, m3);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+    /* Only a fully merged heap holds the largest block */
+    CU_ASSERT((m1 = omalloc(omm, TEST_HEAP_SIZE - 16)) != NULL);
+    omfree(omm, m1);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_buddy_stats()
+{
+    struct omstats stats;
+    void *m;
+
+    CU_ASSERT((m = omalloc(omm, 100)) != NULL);
+    omstats_get(omm, &stats);
+    CU_ASSERT(stats.used == 128 && stats.used_blocks == 1 && stats.classes[7] == 1);
+    /* One free buddy for each order split on the way down from 8MB */
+    CU_ASSERT(stats.free_blocks == 16);
+    CU_ASSERT(stats.largest_free == TEST_HEAP_SIZE / 2);
+    omfree(omm, m);
+    omstats_get(omm, &stats);
+    CU_ASSERT(stats.free_blocks == 1 && stats.largest_free == TEST_HEAP_SIZE);
+}
+
+void test_buddy_realloc()
+{
+    char *m1, *m2;
+    CU_ASSERT((m1 = omalloc(omm, 4000)) != NULL);
+    strcpy(m1, "hello world");
+    CU_ASSERT(omrealloc(omm, m1, 100) == m1);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE - 128);
+    CU_ASSERT((m2 = omalloc(omm, 100)) == m1 + 128);
+    CU_ASSERT(omrealloc(omm, m1, 110) == m1);
+    CU_ASSERT((m1 = omrealloc(omm, m1, 1000)) != NULL);
+    CU_ASSERT(strcmp(m1, "hello world") == 0);
+    omfree(omm, m1);
+    omfree(omm, m2);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_buddy_aligned()
+{
+    CU_ASSERT(omalloc_aligned(omm, 100, 64) == NULL);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_buddy_cached()
+{
+    om_options opts = {.flags = OM_BUDDY | OM_LOCKED | OM_CACHED };
+    om_block *om = omcreate_opts(NULL, TEST_HEAP_SIZE, TEST_HEADROOM, &opts);
+    size_t available = omavailable(om);
+    void *m;
     int i;
 
-    for (i = 0; i < (TEST_HEAP_SIZE / 50); i += 64) {
-        fragments = g_list_prepend(fragments, omalloc(omm, 64));
-        omfree(omm, omalloc(omm, 64));
-    }
-    start = get_time_us();
-    for (i = 0; i < TEST_ITERATIONS_BIG; i++) {
-        allocated = g_list_prepend(allocated, omalloc(omm, 64));
-    }
-    for (iter = allocated; iter; iter = iter->next) {
-        omfree(omm, iter->data);
-    }
-    printf("%" PRIu64 "us ... ", (get_time_us() - start));
-    g_list_free(allocated);
-    for (iter = fragments; iter; iter = iter->next) {
-        omfree(omm, iter->data);
+    CU_ASSERT((m = omalloc(om, 40)) != NULL);
+    omfree(om, m);
+    CU_ASSERT(omalloc(om, 45) == m);
+    omfree(om, m);
+    for (i = 0; i < TEST_ITERATIONS; i++)
+        omfree(om, omalloc(om, 1 + (rand() % 512)));
+    omcache_flush(om);
+    CU_ASSERT(omavailable(om) == available);
+    omdestroy(om);
+}
+
+void test_buddy_growable()
+{
+    backend_growable(OM_BUDDY, NULL);
+}
+
+void test_arena_alloc()
+{
+    omarena *arena = omarena_create(omm, 0);
+    uint64_t *m1, *m2;
+    CU_ASSERT(arena != NULL);
+    CU_ASSERT(omarena_alloc(omm, arena, 0) == NULL);
+    CU_ASSERT((m1 = omarena_alloc(omm, arena, 3)) != NULL);
+    CU_ASSERT((m2 = omarena_alloc(omm, arena, 8)) != NULL);
+    CU_ASSERT((uint8_t *) m2 == (uint8_t *) m1 + 8);
+    *m2 = 0x1234;
+    omarena_destroy(omm, arena);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_arena_large()
+{
+    omarena *arena = omarena_create(omm, 1024);
+    void *m1, *m2, *m3;
+    CU_ASSERT((m1 = omarena_alloc(omm, arena, 64)) != NULL);
+    CU_ASSERT((m2 = omarena_alloc(omm, arena, 4096)) != NULL);
+    memset(m2, 0xff, 4096);
+    CU_ASSERT((m3 = omarena_alloc(omm, arena, 64)) != NULL);
+    CU_ASSERT((uint8_t *) m3 == (uint8_t *) m1 + 64);
+    omarena_destroy(omm, arena);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_arena_reset()
+{
+    omarena *arena = omarena_create(omm, 1024);
+    size_t available;
+    void *first;
+    int i;
+
+    CU_ASSERT((first = omarena_alloc(omm, arena, 16)) != NULL);
+    available = omavailable(omm);
+    for (i = 0; i < TEST_ENTRIES; i++)
+        CU_ASSERT(omarena_alloc(omm, arena, 1 + (i % 500)) != NULL);
+    omarena_reset(omm, arena);
+    CU_ASSERT(omavailable(omm) == available);
+    CU_ASSERT(omarena_alloc(omm, arena, 16) != NULL);
+    omarena_destroy(omm, arena);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
+void test_arena_list()
+{
+    omarena *arena = omarena_create(omm, 0);
+    omlist thelist = OMLIST_INIT;
+    int i;
+
+    for (i = 0; i < TEST_ENTRIES; i++) {
+        omlistentry *e = omarena_alloc(omm, arena, sizeof(omlistentry));
+        memset(e, 0, sizeof(omlistentry));
+        thelist = omlist_prepend(omm, thelist, e);
     }
-    g_list_free(fragments);
+    CU_ASSERT(omlist_length(omm, thelist) == TEST_ENTRIES);
+    omarena_destroy(omm, arena);
     CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
 }
 
@@ -282,6 +1838,8 @@ void test_list_prepend()
     CU_ASSERT(omlist_get(omm, thelist, 0) == (omlistentry *) e1);
     CU_ASSERT(omlist_get(omm, thelist, 1) == (omlistentry *) e);
     CU_ASSERT((thelist = omlist_remove(omm, thelist, (omlistentry *) e1)) != 0);
+    /* A reader stopped on a removed entry can still carry on */
+    CU_ASSERT(omlist_get(omm, omp2o(omm, e1), 1) == (omlistentry *) e);
     CU_ASSERT((thelist = omlist_remove(omm, thelist, (omlistentry *) e)) == 0);
     list_entry_free(e1);
     list_entry_free(e);
@@ -306,6 +1864,34 @@ void test_list_append()
     CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
 }
 
+void test_list_append_removed()
+{
+    omlist thelist = OMLIST_INIT, other = OMLIST_INIT;
+    list_entry *e1 = list_entry_new("dummy1");
+    list_entry *e2 = list_entry_new("dummy2");
+    list_entry *e3 = list_entry_new("dummy3");
+    thelist = omlist_append(omm, thelist, (omlistentry *) e1);
+    thelist = omlist_append(omm, thelist, (omlistentry *) e2);
+    thelist = omlist_append(omm, thelist, (omlistentry *) e3);
+    thelist = omlist_remove(omm, thelist, (omlistentry *) e2);
+    /* A reused entry does not bring its old list along */
+    other = omlist_append(omm, other, (omlistentry *) e2);
+    CU_ASSERT(omlist_length(omm, other) == 1);
+    CU_ASSERT((other = omlist_remove(omm, other, (omlistentry *) e2)) == 0);
+    thelist = omlist_append(omm, thelist, (omlistentry *) e2);
+    CU_ASSERT(omlist_length(omm, thelist) == 3);
+    CU_ASSERT(omlist_get(omm, thelist, 2) == (omlistentry *) e2);
+    CU_ASSERT(omlist_check(omm, thelist) == 0);
+    thelist = omlist_remove(omm, thelist, (omlistentry *) e1);
+    thelist = omlist_remove(omm, thelist, (omlistentry *) e2);
+    thelist = omlist_remove(omm, thelist, (omlistentry *) e3);
+    list_entry_free(e1);
+    list_entry_free(e2);
+    list_entry_free(e3);
+    CU_ASSERT(omlist_length(omm, thelist) == 0);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
 void test_list_length()
 {
     omlist thelist = OMLIST_INIT;
@@ -788,6 +2374,55 @@ void test_htable_find_removed()
     CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
 }
 
+static size_t htable_entry_hash(om_block * om, omhtentry * e)
+{
+    return omhtable_strhash(((htable_entry *) e)->str);
+}
+
+void test_htable_check()
+{
+    omhtable *htable = create_table(TEST_HASH_TABLE_SIZE);
+    htable_entry *e[100];
+    offset_t saved;
+    char key[16];
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        sprintf(key, "key%d", i);
+        e[i] = htable_entry_new(key);
+        omhtable_add(omm, htable, omhtable_strhash(key), (omhtentry *) e[i]);
+    }
+    CU_ASSERT(omhtable_check(omm, htable, htable_entry_hash, 0) == 0);
+    CU_ASSERT(omhtable_check(omm, htable, NULL, 1) == 0);
+
+    /* An entry in the wrong bucket is only seen with the hash */
+    omhtable_delete(omm, htable, omhtable_strhash("key0"), (omhtentry *) e[0]);
+    omhtable_add(omm, htable, omhtable_strhash("key0") + 1, (omhtentry *) e[0]);
+    CU_ASSERT(omhtable_check(omm, htable, htable_entry_hash, 0) == 1);
+    CU_ASSERT(omhtable_check(omm, htable, NULL, 0) == 0);
+
+    /* A loop, then a broken back-link */
+    saved = e[0]->base.next;
+    e[0]->base.next = omp2o(omm, e[0]);
+    CU_ASSERT(omhtable_check(omm, htable, NULL, 0) == 1);
+    e[0]->base.next = saved;
+    e[0]->base.prev = omp2o(omm, e[1]);
+    CU_ASSERT(omhtable_check(omm, htable, NULL, 0) == 1);
+    e[0]->base.prev = 0;
+    CU_ASSERT(omlist_check(omm, htable->table[(omhtable_strhash("key0") + 1) %
+                                              TEST_HASH_TABLE_SIZE]) == 0);
+
+    omhtable_delete(omm, htable, omhtable_strhash("key0") + 1, (omhtentry *) e[0]);
+    htable_entry_free(e[0]);
+    for (i = 1; i < 100; i++) {
+        omhtable_delete(omm, htable, omhtable_strhash(e[i]->str), (omhtentry *) e[i]);
+        htable_entry_free(e[i]);
+    }
+    CU_ASSERT(omhtable_size(omm, htable) == 0);
+    destroy_table(htable);
+    CU_ASSERT(omavailable(omm) == TEST_HEAP_SIZE);
+}
+
 void test_htable_add_performance()
 {
     omhtable *htable = create_table(TEST_HASH_TABLE_SIZE);
@@ -1211,6 +2846,30 @@ static CU_TestInfo tests_malloc[] = {
     {"malloc 1 byte", test_malloc1},
     {"malloc twice", test_malloc_twice},
     {"malloc twice reverse free", test_malloc_twice_reverse},
+    {"malloc reuse", test_malloc_reuse},
+    {"malloc mixed sizes", test_malloc_mixed_sizes},
+    {"malloc no footer", test_malloc_no_footer},
+    {"malloc footprint", test_malloc_footprint},
+    {"malloc big heap", test_malloc_big_heap},
+    {"stats", test_stats},
+    {"profile", test_profile},
+    {"snapshot", test_snapshot},
+    {"check", test_check},
+    {"realloc null", test_realloc_null},
+    {"realloc grow in place", test_realloc_grow_in_place},
+    {"realloc shrink in place", test_realloc_shrink_in_place},
+    {"realloc move", test_realloc_move},
+    {"calloc fresh", test_calloc_fresh},
+    {"calloc reused", test_calloc_reused},
+    {"calloc whole heap", test_calloc_whole_heap},
+    {"calloc overflow", test_calloc_overflow},
+    {"malloc aligned", test_malloc_aligned},
+    {"malloc aligned bad alignment", test_malloc_aligned_bad},
+    {"malloc bulk", test_malloc_bulk},
+    {"free bulk mixed", test_free_bulk_mixed},
+    {"malloc bulk performance", test_malloc_bulk_performance},
+    {"malloc best fit", test_malloc_best_fit},
+    {"malloc large random", test_malloc_large_random},
     {"malloc until fail", test_malloc_until_fail},
     {"malloc performance", test_malloc_performance},
     {"glib malloc performance", test_glib_malloc_performance},
@@ -1218,11 +2877,97 @@ static CU_TestInfo tests_malloc[] = {
     CU_TEST_INFO_NULL,
 };
 
+static CU_TestInfo tests_concurrency[] = {
+    {"recursive lock", test_locked_recursive},
+    {"multiple processes", test_locked_processes},
+    {"owner died", test_locked_owner_died},
+    {"cached reuse", test_cached_reuse},
+    {"cached overflow", test_cached_overflow},
+    {"cached threads", test_cached_threads},
+    {"epoch reclaim", test_epoch_reclaim},
+    {"epoch processes", test_epoch_processes},
+    CU_TEST_INFO_NULL,
+};
+
+static CU_TestInfo tests_backend[] = {
+    {"file", test_backend_file},
+    {"posix shm", test_backend_shm},
+    {"memfd", test_backend_memfd},
+    {"private thp", test_backend_private_thp},
+    {"incompatible", test_backend_incompatible},
+    {"attach sysv", test_backend_attach_sysv},
+    {"attach wait", test_backend_attach_wait},
+    {"grow file", test_backend_grow_file},
+    {"grow private", test_backend_grow_private},
+    {"grow sysv", test_backend_grow_sysv},
+    {"release private", test_backend_release_private},
+    {"release memfd", test_backend_release_memfd},
+    {"release shm", test_backend_release_shm},
+    {"warm sysv", test_backend_warm_sysv},
+    {"warm file", test_backend_warm_file},
+    {"persist file", test_backend_persist_file},
+    {"restore file", test_backend_restore_file},
+    CU_TEST_INFO_NULL,
+};
+
+static CU_TestInfo tests_slab[] = {
+    {"alloc/free", test_slab_alloc_free},
+    {"bad size", test_slab_bad_size},
+    {"many pages", test_slab_many_pages},
+    {"threads", test_slab_threads},
+    CU_TEST_INFO_NULL,
+};
+
+static CU_TestInfo tests_handle[] = {
+    {"alloc and free", test_handle_alloc_free},
+    {"compact", test_handle_compact},
+    {"compact interleaved", test_handle_compact_interleaved},
+    CU_TEST_INFO_NULL,
+};
+
+static CU_TestInfo tests_buddy[] = {
+    {"malloc 0 bytes", test_malloc_0},
+    {"free_null", test_free_null},
+    {"malloc 1 byte", test_malloc1},
+    {"malloc twice", test_malloc_twice},
+    {"malloc twice reverse free", test_malloc_twice_reverse},
+    {"malloc reuse", test_malloc_reuse},
+    {"malloc mixed sizes", test_malloc_mixed_sizes},
+    {"split and merge", test_buddy_split_merge},
+    {"stats", test_buddy_stats},
+    {"snapshot", test_snapshot},
+    {"check", test_check},
+    {"realloc null", test_realloc_null},
+    {"realloc move", test_realloc_move},
+    {"realloc", test_buddy_realloc},
+    {"calloc fresh", test_calloc_fresh},
+    {"calloc reused", test_calloc_reused},
+    {"calloc overflow", test_calloc_overflow},
+    {"malloc aligned", test_buddy_aligned},
+    {"malloc bulk", test_malloc_bulk},
+    {"free bulk mixed", test_free_bulk_mixed},
+    {"malloc large random", test_malloc_large_random},
+    {"cached", test_buddy_cached},
+    {"growable", test_buddy_growable},
+    {"malloc performance", test_malloc_performance},
+    {"malloc performance fragmented", test_malloc_performance_fragmented},
+    CU_TEST_INFO_NULL,
+};
+
+static CU_TestInfo tests_arena[] = {
+    {"alloc", test_arena_alloc},
+    {"large", test_arena_large},
+    {"reset", test_arena_reset},
+    {"scratch list", test_arena_list},
+    CU_TEST_INFO_NULL,
+};
+
 static CU_TestInfo tests_list[] = {
     {"add/remove", test_list_add_remove},
     {"remove not there", test_list_remove_not_there},
     {"prepend", test_list_prepend},
     {"append", test_list_append},
+    {"append removed", test_list_append_removed},
     {"length", test_list_length},
     {"get", test_list_get},
     {"reverse", test_list_reverse},
@@ -1249,6 +2994,7 @@ static CU_TestInfo tests_htable[] = {
     {"find wrong hash", test_htable_find_wrong_hash},
     {"find not there", test_htable_find_not_there},
     {"find removed", test_htable_find_removed},
+    {"check", test_htable_check},
     {"add performance 5000 entries 32 buckets", test_htable_add_performance},
     {"delete performance 5000 entries 32 buckets", test_htable_delete_performance},
     {"find performance 5000 entries 32 buckets", test_htable_find_perf_32buckets},
@@ -1277,6 +3023,12 @@ static CU_TestInfo tests_htree[] = {
 
 static CU_SuiteInfo suites[] = {
     {"Malloc tests", suite_init, suite_shutdown, 0, 0, tests_malloc},
+    {"Concurrency tests", suite_init, suite_shutdown, 0, 0, tests_concurrency},
+    {"Backend tests", suite_init, suite_shutdown, 0, 0, tests_backend},
+    {"Slab tests", suite_init, suite_shutdown, 0, 0, tests_slab},
+    {"Handle tests", suite_init, suite_shutdown, 0, 0, tests_handle},
+    {"Buddy tests", suite_init_buddy, suite_shutdown_buddy, 0, 0, tests_buddy},
+    {"Arena tests", suite_init, suite_shutdown, 0, 0, tests_arena},
     {"List tests", suite_init, suite_shutdown, 0, 0, tests_list},
     {"Hash Table tests", suite_init, suite_shutdown, 0, 0, tests_htable},
     {"Hash Tree tests", suite_init, suite_shutdown, 0, 0, tests_htree},